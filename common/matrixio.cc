@@ -0,0 +1,151 @@
+#include "matrixio.h"
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "error.h"
+
+static const char npy_magic[] = "\x93NUMPY";
+constexpr std::size_t npy_magic_size = 6;
+constexpr std::size_t npy_alignment = 64;
+
+MappedMatrix::~MappedMatrix() {
+    if (mapping) {
+        munmap(mapping, bytes);
+    }
+}
+
+// Releases the old mapping of m and makes it the matrix of ny rows of nx
+// floats at p + data_start in the mapping of bytes at p.
+static void set_mapping(MappedMatrix& m, char* p, std::size_t bytes, std::size_t data_start, int ny, int nx) {
+    if (m.mapping) {
+        munmap(m.mapping, m.bytes);
+    }
+    m.mapping = p;
+    m.bytes = bytes;
+    m.ny = ny;
+    m.nx = nx;
+    m.data = reinterpret_cast<float*>(p + data_start);
+}
+
+// Maps bytes of fd, or does nothing for an empty file.
+static void* map_file(int fd, std::size_t bytes, int prot, int flags, const char* filename) {
+    if (bytes == 0) {
+        return nullptr;
+    }
+    void* p = mmap(nullptr, bytes, prot, flags, fd, 0);
+    if (p == MAP_FAILED) {
+        error(filename, "cannot map file");
+    }
+    return p;
+}
+
+// Returns the value of key in the header dictionary, up to the next
+// comma outside parentheses.
+static std::string header_value(const std::string& header, const std::string& key, const char* filename) {
+    std::size_t at = header.find("'" + key + "'");
+    if (at == std::string::npos || (at = header.find(':', at)) == std::string::npos) {
+        error(filename, "no " + key + " in .npy header");
+    }
+    int depth = 0;
+    std::size_t end = at + 1;
+    for (; end < header.size(); ++end) {
+        char c = header[end];
+        depth += c == '(';
+        depth -= c == ')';
+        if ((c == ',' && depth == 0) || c == '}') {
+            break;
+        }
+    }
+    std::size_t first = header.find_first_not_of(' ', at + 1);
+    std::size_t last = header.find_last_not_of(' ', end - 1);
+    return header.substr(first, last + 1 - first);
+}
+
+void read_matrix(MappedMatrix& m, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        error(filename, "cannot open for reading");
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        error(filename, "cannot read file size");
+    }
+    std::size_t bytes = info.st_size;
+    char* p = static_cast<char*>(map_file(fd, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, filename));
+    close(fd);
+
+    if (bytes < npy_magic_size + 4 || std::memcmp(p, npy_magic, npy_magic_size) != 0) {
+        error(filename, "not a .npy file");
+    }
+    int major = static_cast<unsigned char>(p[6]);
+    std::size_t header_size = static_cast<unsigned char>(p[8]) | static_cast<unsigned char>(p[9]) << 8;
+    std::size_t header_start = 10;
+    if (major >= 2) {
+        if (bytes < 12) {
+            error(filename, "truncated .npy header");
+        }
+        header_size |= static_cast<std::size_t>(static_cast<unsigned char>(p[10])) << 16;
+        header_size |= static_cast<std::size_t>(static_cast<unsigned char>(p[11])) << 24;
+        header_start = 12;
+    }
+    if (major < 1 || major > 3 || header_start + header_size > bytes) {
+        error(filename, "unsupported .npy version");
+    }
+    std::string header(p + header_start, header_size);
+    std::string descr = header_value(header, "descr", filename);
+    if (descr != "'<f4'" && descr != "'float32'") {
+        error(filename, "only float32 .npy files are supported, not " + descr);
+    }
+    if (header_value(header, "fortran_order", filename) != "False") {
+        error(filename, "only C-order .npy files are supported");
+    }
+    std::string shape = header_value(header, "shape", filename);
+    long long ny = 0;
+    long long nx = 0;
+    if (std::sscanf(shape.c_str(), "(%lld,%lld)", &ny, &nx) != 2 || ny < 0 || nx < 0) {
+        error(filename, "only 2-D .npy files are supported, not " + shape);
+    }
+    if (ny > INT_MAX || nx > INT_MAX) {
+        error(filename, "matrix too large: " + shape);
+    }
+    //checked by division first, so that ny * nx cannot overflow
+    std::size_t data_start = header_start + header_size;
+    std::size_t data_floats = (bytes - data_start) / sizeof(float);
+    if ((nx > 0 && (std::size_t)ny > data_floats / nx) || data_start + sizeof(float) * ny * nx != bytes) {
+        error(filename, "size of .npy data does not match shape " + shape);
+    }
+    madvise(p, bytes, MADV_SEQUENTIAL);
+    set_mapping(m, p, bytes, data_start, ny, nx);
+}
+
+void create_matrix(MappedMatrix& m, const char* filename, int ny, int nx) {
+    //header padded with spaces so that the data start on a 64-byte boundary
+    std::string header = "{'descr': '<f4', 'fortran_order': False, 'shape': ("
+        + std::to_string(ny) + ", " + std::to_string(nx) + "), }";
+    std::size_t data_start = (npy_magic_size + 4 + header.size() + 1 + npy_alignment - 1) / npy_alignment * npy_alignment;
+    header.resize(data_start - npy_magic_size - 4 - 1, ' ');
+    header += '\n';
+    std::size_t bytes = data_start + sizeof(float) * ny * nx;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error(filename, "cannot open for writing");
+    }
+    if (ftruncate(fd, bytes) != 0) {
+        error(filename, "cannot resize output file");
+    }
+    char* p = static_cast<char*>(map_file(fd, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, filename));
+    close(fd);
+    std::memcpy(p, npy_magic, npy_magic_size);
+    p[6] = 1;
+    p[7] = 0;
+    p[8] = header.size() & 0xff;
+    p[9] = header.size() >> 8;
+    std::memcpy(p + npy_magic_size + 4, header.data(), header.size());
+    set_mapping(m, p, bytes, data_start, ny, nx);
+}
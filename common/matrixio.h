@@ -0,0 +1,33 @@
+#ifndef MATRIXIO_H
+#define MATRIXIO_H
+
+#include <cstddef>
+
+// A matrix of ny rows of nx floats, row y at data + y*nx, memory-mapped
+// from a .npy file: a 2-D array with dtype '<f4' in C order. The files
+// written here use format version 1.0 and start the data on a 64-byte
+// boundary, so data is aligned for vector loads; files from numpy are
+// read in versions 1.0 to 3.0. The mapping is released by the destructor.
+struct MappedMatrix {
+    int ny = 0;
+    int nx = 0;
+    float* data = nullptr;
+    // The whole mapped file, header included.
+    void* mapping = nullptr;
+    std::size_t bytes = 0;
+
+    MappedMatrix() = default;
+    MappedMatrix(const MappedMatrix&) = delete;
+    MappedMatrix& operator=(const MappedMatrix&) = delete;
+    ~MappedMatrix();
+};
+
+// Maps an existing file. The pages are private: writes to data are
+// allowed but never reach the file.
+void read_matrix(MappedMatrix& m, const char* filename);
+
+// Creates the file for a zero-filled ny * nx matrix and maps it shared,
+// so whatever is stored in data is written to the file.
+void create_matrix(MappedMatrix& m, const char* filename, int ny, int nx);
+
+#endif
@@ -5,25 +5,99 @@
 #include <stdexcept>
 #include <memory>
 #include <vector>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
 
 // C++ aligned allocation convenience functions
 namespace ppc {
-    // C++ memory allocator that allocates 32-byte aligned memory.
+    // Alignment of a type, raised to at least Alignment bytes and to
+    // what posix_memalign accepts.
+    template <typename T, std::size_t Alignment>
+    constexpr std::size_t alignment_of() {
+        std::size_t a = alignof(T) > Alignment ? alignof(T) : Alignment;
+        return a > sizeof(void*) ? a : sizeof(void*);
+    }
+
+    // Alignment of a cache line or a 512-bit vector.
+    constexpr std::size_t cache_line = 64;
+
+    // Size of a transparent huge page on x86-64.
+    constexpr std::size_t huge_page = std::size_t(2) << 20;
+
+    // Page placement hints for large buffers, combine with |. Without
+    // hints a page lands on the NUMA node of the thread that first
+    // writes it, so initialize buffers with the same parallel loop that
+    // later consumes them.
+    enum placement : unsigned {
+        placement_default = 0,
+        // Back the buffer with 2 MB transparent huge pages if allowed.
+        placement_huge_pages = 1,
+        // Spread the pages round-robin over all NUMA nodes allowed for
+        // this process, for buffers that every thread reads.
+        placement_interleave = 2,
+    };
+
+    // Alignment needed for the placement hints to cover whole pages.
+    inline std::size_t placement_alignment(std::size_t bytes, unsigned placement) {
+        if ((placement & placement_huge_pages) && bytes >= huge_page) {
+            return huge_page;
+        }
+        if (placement & placement_interleave) {
+            return sysconf(_SC_PAGESIZE);
+        }
+        return 0;
+    }
+
+    // Applies placement hints to memory that has not been written yet.
+    // The hints are advisory: on kernels or machines without huge pages
+    // or NUMA they are silently ignored.
+    inline void advise(void* p, std::size_t bytes, unsigned placement) {
+        if (p == nullptr || bytes == 0) {
+            return;
+        }
+        if ((placement & placement_huge_pages) && bytes >= huge_page) {
+            madvise(p, bytes, MADV_HUGEPAGE);
+        }
+        if (placement & placement_interleave) {
+            constexpr unsigned long bits = 8 * sizeof(unsigned long);
+            constexpr unsigned long maxnode = 1024;
+            unsigned long nodes[maxnode / bits] = {};
+            if (syscall(SYS_get_mempolicy, nullptr, nodes, maxnode, nullptr, MPOL_F_MEMS_ALLOWED) == 0) {
+                syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE, nodes, maxnode, 0);
+            }
+        }
+    }
+
+    // C++ memory allocator that allocates memory aligned to the type,
+    // or to Alignment bytes if that is larger (e.g. ppc::cache_line), and
+    // applies the Placement hints.
     // Useful with for example std::vector
-    template <typename T>
+    template <typename T, std::size_t Alignment = alignof(T), unsigned Placement = placement_default>
     struct allocator {
         typedef T value_type;
 
+        template <typename U>
+        struct rebind {
+            typedef allocator<U, Alignment, Placement> other;
+        };
+
         allocator() = default;
 
         template <typename U>
-        constexpr allocator(const allocator<U>&) noexcept {}
+        constexpr allocator(const allocator<U, Alignment, Placement>&) noexcept {}
 
         T* allocate(std::size_t n) {
             T* ret = nullptr;
-            if (posix_memalign((void**)&ret, alignof(T), n*sizeof(T))) {
+            std::size_t alignment = alignment_of<T, Alignment>();
+            if (placement_alignment(n*sizeof(T), Placement) > alignment) {
+                alignment = placement_alignment(n*sizeof(T), Placement);
+            }
+            if (posix_memalign((void**)&ret, alignment, n*sizeof(T))) {
                 throw std::bad_alloc();
             }
+            advise(ret, n*sizeof(T), Placement);
             return ret;
         }
 
@@ -32,13 +106,13 @@ namespace ppc {
         }
     };
 
-    template <typename T, typename U>
-    bool operator==(const allocator<T>&, const allocator<U>&) { return true; }
-    template <typename T, typename U>
-    bool operator!=(const allocator<T>&, const allocator<U>&) { return false; }
+    template <typename T, typename U, std::size_t A, unsigned P>
+    bool operator==(const allocator<T, A, P>&, const allocator<U, A, P>&) { return true; }
+    template <typename T, typename U, std::size_t A, unsigned P>
+    bool operator!=(const allocator<T, A, P>&, const allocator<U, A, P>&) { return false; }
 
-    template <typename T>
-    using vector = std::vector<T, allocator<T>>;
+    template <typename T, std::size_t Alignment = alignof(T), unsigned Placement = placement_default>
+    using vector = std::vector<T, allocator<T, Alignment, Placement>>;
 
     template <typename T>    
     struct free_deleter {
@@ -50,12 +124,25 @@ namespace ppc {
     template <typename T>
     using unique_ptr = std::unique_ptr<T, free_deleter<T>>;
 
+    // Allocates count elements aligned to the type, or to alignment
+    // bytes if that is larger (e.g. ppc::cache_line or page_size()), and
+    // applies the placement hints.
     template <typename T>
-    unique_ptr<T> alloc(size_t count) {
+    unique_ptr<T> alloc(size_t count, size_t alignment = alignof(T), unsigned placement = placement_default) {
         T* ptr = nullptr;
-        if (posix_memalign((void**)&ptr, alignof(T), count*sizeof(T))) {
+        if (alignment < alignof(T)) {
+            alignment = alignof(T);
+        }
+        if (alignment < sizeof(void*)) {
+            alignment = sizeof(void*);
+        }
+        if (placement_alignment(count*sizeof(T), placement) > alignment) {
+            alignment = placement_alignment(count*sizeof(T), placement);
+        }
+        if (posix_memalign((void**)&ptr, alignment, count*sizeof(T))) {
             return nullptr;
         }
+        advise(ptr, count*sizeof(T), placement);
         return unique_ptr<T>(ptr);
     }
 }
@@ -0,0 +1,183 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+#include <vector>
+#include <omp.h>
+
+namespace ppc {
+    // Time each thread spent working in parallel_tiles, summed over all
+    // calls since the last reset(), and the number of successful steals.
+    struct schedule_stats {
+        std::vector<double> busy;
+        long long steals = 0;
+
+        void reset() {
+            busy.clear();
+            steals = 0;
+        }
+    };
+
+    inline schedule_stats last_schedule;
+
+    // Rows [y0, y1) and columns [x0, x1) of a matrix.
+    struct tile_range {
+        int y0, y1;
+        int x0, x1;
+    };
+
+    // Orders of the tiles of triangle_tiles.
+    enum class tile_order {
+        rows,
+        hilbert
+    };
+
+    // Position of cell (x, y) along the Hilbert curve through an n x n
+    // grid, n a power of two.
+    inline long long hilbert_index(int n, int x, int y) {
+        long long d = 0;
+        for (int s = n / 2; s > 0; s /= 2) {
+            int rx = (x & s) > 0;
+            int ry = (y & s) > 0;
+            d += (long long)s * s * ((3 * rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    }
+
+    // Splits the part of [y0, y1) x [x0, x1) on or above the diagonal into
+    // tiles of tileRows x tileCols, so that all tiles except the ones on
+    // the diagonal and the edges cost the same. Diagonal tiles still
+    // contain cells below the diagonal; the caller skips them.
+    //
+    // With tile_order::rows, tiles are listed row band by row band, so
+    // neighbours in the list share their rows. With tile_order::hilbert,
+    // they follow a Hilbert curve over the grid of tiles: neighbours share
+    // their rows or their columns, and any stretch of the list, such as
+    // the part each thread of parallel_tiles starts with, covers a compact
+    // square-ish region, whose row and column bands fit in cache together.
+    inline std::vector<tile_range> triangle_tiles(int y0, int y1, int x0, int x1, int tileRows, int tileCols, tile_order order = tile_order::rows) {
+        std::vector<tile_range> tiles;
+        for (int ty = y0; ty < y1; ty += tileRows) {
+            for (int tx = x0; tx < x1; tx += tileCols) {
+                tile_range tile = {ty, std::min(ty + tileRows, y1), tx, std::min(tx + tileCols, x1)};
+                if (tile.x1 > tile.y0) {
+                    tiles.push_back(tile);
+                }
+            }
+        }
+        if (order == tile_order::hilbert && !tiles.empty()) {
+            int n = 1;
+            while (n * tileRows < y1 - y0 || n * tileCols < x1 - x0) {
+                n *= 2;
+            }
+            std::vector<std::pair<long long, tile_range>> keyed;
+            keyed.reserve(tiles.size());
+            for (const tile_range& tile : tiles) {
+                keyed.push_back({hilbert_index(n, (tile.x0 - x0) / tileCols, (tile.y0 - y0) / tileRows), tile});
+            }
+            std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) {
+                return a.first < b.first;
+            });
+            for (std::size_t t = 0; t < tiles.size(); ++t) {
+                tiles[t] = keyed[t].second;
+            }
+        }
+        return tiles;
+    }
+
+    // Runs body(tile) for every tile on all threads. Each thread starts
+    // with a contiguous part of the list and works through it from the
+    // front; a thread that runs out steals the back half of another
+    // thread's remaining part, so the tail of the work is shared out
+    // without giving up the locality of the list order. makeBody() is
+    // called once on every thread to create that thread's body.
+    template <typename MakeBody>
+    void parallel_tiles(const std::vector<tile_range>& tiles, const MakeBody& makeBody) {
+        using clock = std::chrono::steady_clock;
+        struct alignas(64) queue {
+            omp_lock_t lock;
+            int begin;
+            int end;
+        };
+
+        const int nTiles = tiles.size();
+        const int nThreads = omp_get_max_threads();
+        std::vector<queue> queues(nThreads);
+        for (int t = 0; t < nThreads; ++t) {
+            omp_init_lock(&queues[t].lock);
+            queues[t].begin = (long long)nTiles * t / nThreads;
+            queues[t].end = (long long)nTiles * (t + 1) / nThreads;
+        }
+        std::vector<double> busy(nThreads);
+        long long steals = 0;
+
+        #pragma omp parallel num_threads(nThreads) reduction(+:steals)
+        {
+            const int t = omp_get_thread_num();
+            const clock::time_point start = clock::now();
+            auto body = makeBody();
+            queue& own = queues[t];
+            for (;;) {
+                omp_set_lock(&own.lock);
+                int i = own.begin < own.end ? own.begin++ : -1;
+                omp_unset_lock(&own.lock);
+                if (i >= 0) {
+                    body(tiles[i]);
+                    continue;
+                }
+                //own part done, look for the fullest other part; the unlocked
+                //sizes are only a hint and are checked again under the lock
+                int victim = -1;
+                int most = 0;
+                for (int v = 0; v < nThreads; ++v) {
+                    int left = queues[v].end - queues[v].begin;
+                    if (v != t && left > most) {
+                        victim = v;
+                        most = left;
+                    }
+                }
+                if (victim < 0) {
+                    break;
+                }
+                omp_set_lock(&queues[victim].lock);
+                int left = queues[victim].end - queues[victim].begin;
+                int end = queues[victim].end;
+                int begin = end - (left + 1) / 2;
+                if (left > 0) {
+                    queues[victim].end = begin;
+                }
+                omp_unset_lock(&queues[victim].lock);
+                if (left > 0) {
+                    omp_set_lock(&own.lock);
+                    own.begin = begin;
+                    own.end = end;
+                    omp_unset_lock(&own.lock);
+                    ++steals;
+                }
+            }
+            busy[t] = std::chrono::duration<double>(clock::now() - start).count();
+        }
+
+        for (int t = 0; t < nThreads; ++t) {
+            omp_destroy_lock(&queues[t].lock);
+        }
+        if ((int)last_schedule.busy.size() < nThreads) {
+            last_schedule.busy.resize(nThreads);
+        }
+        for (int t = 0; t < nThreads; ++t) {
+            last_schedule.busy[t] += busy[t];
+        }
+        last_schedule.steals += steals;
+    }
+}
+
+#endif
@@ -2,36 +2,70 @@
 #define VECTOR_H
 
 #include <cstdlib>
+#include <unistd.h>
 
 typedef float float4_t __attribute__ ((vector_size (16)));
 typedef float float8_t __attribute__ ((vector_size (32)));
+typedef float float16_t __attribute__ ((vector_size (64)));
 typedef double double4_t __attribute__ ((vector_size (32)));
+typedef double double8_t __attribute__ ((vector_size (64)));
+// Eight 16-bit floats (bf16 or fp16) as raw bits, for compact storage;
+// widen them to float8_t for arithmetic.
+typedef unsigned short half8_t __attribute__ ((vector_size (16)));
+// Integer vectors for quantized data, named by lane type and count.
+typedef signed char int8x16_t __attribute__ ((vector_size (16)));
+typedef short int16x16_t __attribute__ ((vector_size (32)));
+typedef int int32x8_t __attribute__ ((vector_size (32)));
 
 constexpr float4_t float4_0 = {0,0,0,0};
 constexpr float8_t float8_0 = {0,0,0,0,0,0,0,0};
+constexpr float16_t float16_0 = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
 constexpr double4_t double4_0 = {0,0,0,0};
+constexpr double8_t double8_0 = {0,0,0,0,0,0,0,0};
 
-// Basic malloc replacement, retuns memory aligned to 32 bytes.
+// Size of a virtual memory page, for page-aligned allocations.
+inline std::size_t page_size() {
+    return sysconf(_SC_PAGESIZE);
+}
+
+// Basic malloc replacement, retuns memory aligned to 32 bytes, or to
+// the given power of two that is a multiple of sizeof(void*).
 // Free with free()
-inline void* aligned_malloc(std::size_t bytes) {
+inline void* aligned_malloc(std::size_t bytes, std::size_t alignment = 32) {
     void* ret = nullptr;
-    if (posix_memalign(&ret, 32, bytes)) {
+    if (posix_memalign(&ret, alignment, bytes)) {
         return nullptr;
     }
     return ret;
 }
 
-// Typed allocators
-inline float4_t* float4_alloc(std::size_t n) {
-    return static_cast<float4_t*>(aligned_malloc(sizeof(float4_t) * n));
+// Typed allocators, at least 32-byte aligned (64 for the 512-bit types)
+inline float4_t* float4_alloc(std::size_t n, std::size_t alignment = 32) {
+    return static_cast<float4_t*>(aligned_malloc(sizeof(float4_t) * n, alignment));
+}
+
+inline float8_t* float8_alloc(std::size_t n, std::size_t alignment = 32) {
+    return static_cast<float8_t*>(aligned_malloc(sizeof(float8_t) * n, alignment));
+}
+
+inline float16_t* float16_alloc(std::size_t n, std::size_t alignment = 64) {
+    return static_cast<float16_t*>(aligned_malloc(sizeof(float16_t) * n, alignment));
+}
+
+inline double4_t* double4_alloc(std::size_t n, std::size_t alignment = 32) {
+    return static_cast<double4_t*>(aligned_malloc(sizeof(double4_t) * n, alignment));
+}
+
+inline half8_t* half8_alloc(std::size_t n, std::size_t alignment = 32) {
+    return static_cast<half8_t*>(aligned_malloc(sizeof(half8_t) * n, alignment));
 }
 
-inline float8_t* float8_alloc(std::size_t n) {
-    return static_cast<float8_t*>(aligned_malloc(sizeof(float8_t) * n));
+inline int8x16_t* int8x16_alloc(std::size_t n, std::size_t alignment = 32) {
+    return static_cast<int8x16_t*>(aligned_malloc(sizeof(int8x16_t) * n, alignment));
 }
 
-inline double4_t* double4_alloc(std::size_t n) {
-    return static_cast<double4_t*>(aligned_malloc(sizeof(double4_t) * n));
+inline double8_t* double8_alloc(std::size_t n, std::size_t alignment = 64) {
+    return static_cast<double8_t*>(aligned_malloc(sizeof(double8_t) * n, alignment));
 }
 
 #endif
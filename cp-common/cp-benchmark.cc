@@ -3,34 +3,203 @@
 #include <iostream>
 #include <vector>
 #include <random>
+#include <string>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
 #include "error.h"
 #include "timer.h"
+#include "matrixio.h"
+#include "memory.h"
 #include "cp.h"
+#ifdef _OPENMP
+#include "scheduler.h"
+#endif
 
-static void benchmark(int ny, int nx) {
+// Result matrix placed as cp.h recommends, so that the timings on NUMA
+// machines are not limited by the memory of one node.
+typedef ppc::vector<float, ppc::cache_line, ppc::placement_huge_pages | ppc::placement_interleave> result_vector;
+
+static void generate(int ny, int nx, std::vector<float>& data) {
     std::mt19937 rng;
     std::uniform_real_distribution<float> u(0.0f, 1.0f);
-    std::vector<float> data(ny * nx);
-    std::vector<float> result(ny * ny);
+    data.resize((std::size_t)ny * nx);
     for (int y = 0; y < ny; ++y) {
         for (int x = 0; x < nx; ++x) {
             float v = u(rng);
-            data[x + nx * y] = v;
+            data[x + (std::size_t)nx * y] = v;
         }
     }
+}
+
+#ifdef _OPENMP
+// Prints how long each thread was busy in the scheduled product, if the
+// implementation uses ppc::parallel_tiles; the spread between the
+// threads shows how well the work was balanced.
+static void print_schedule() {
+    const ppc::schedule_stats& stats = ppc::last_schedule;
+    if (stats.busy.empty()) {
+        return;
+    }
+    std::ios_base::fmtflags oldf = std::cout.flags(std::ios::right | std::ios::fixed);
+    std::streamsize oldp = std::cout.precision(3);
+    std::cout << "busy";
+    for (double seconds : stats.busy) {
+        std::cout << "\t" << seconds;
+    }
+    std::cout << "\tsteals\t" << stats.steals << std::endl;
+    std::cout.flags(oldf);
+    std::cout.precision(oldp);
+}
+#endif
+
+static void benchmark_data(int ny, int nx, const float* data) {
+    result_vector result((std::size_t)ny * ny);
     std::cout << "cp\t" << ny << "\t" << nx << "\t" << std::flush;
-    { ppc::timer t; correlate(ny, nx, data.data(), result.data()); }
+#ifdef _OPENMP
+    ppc::last_schedule.reset();
+#endif
+    { ppc::timer t; correlate(ny, nx, data, result.data()); }
     std::cout << std::endl;
+#ifdef _OPENMP
+    print_schedule();
+#endif
 }
 
+static void benchmark(int ny, int nx) {
+    std::vector<float> data;
+    generate(ny, nx, data);
+    benchmark_data(ny, nx, data.data());
+}
+
+// Writes the random input of benchmark(ny, nx) to a .npy file, so that
+// later runs can map it with -i instead of generating it again.
+static void generate_file(int ny, int nx, const char* filename) {
+    std::vector<float> data;
+    generate(ny, nx, data);
+    MappedMatrix m;
+    create_matrix(m, filename, ny, nx);
+    std::copy(data.begin(), data.end(), m.data);
+}
+
+#ifdef CP_EXTENDED_API
+// Streams the result to a memory-mapped file instead of keeping it in
+// memory, so ny can be large enough that the result exceeds RAM.
+static void benchmark_stream(int ny, int nx, const char* filename) {
+    std::vector<float> data;
+    generate(ny, nx, data);
+    std::cout << "cp\t" << ny << "\t" << nx << "\t" << std::flush;
+#ifdef _OPENMP
+    ppc::last_schedule.reset();
+#endif
+    { ppc::timer t; correlate_to_file(ny, nx, data.data(), filename, 1200); }
+    std::cout << std::endl;
+#ifdef _OPENMP
+    print_schedule();
+#endif
+}
+
+// Times every variant of the tile kernel on this machine, taking the best
+// of iter runs each, and saves the fastest one to the tuning file that
+// correlate() reads at startup.
+static void autotune(int ny, int nx, int iter) {
+    std::vector<float> data;
+    generate(ny, nx, data);
+    result_vector result((std::size_t)ny * ny);
+    correlate(ny, nx, data.data(), result.data());
+    int best = 0;
+    double bestSeconds = 0.0;
+    for (int variant = 0; variant < cp_tune_variants(); ++variant) {
+        cp_tune_select(variant);
+        double seconds = 0.0;
+        for (int i = 0; i < iter; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            correlate(ny, nx, data.data(), result.data());
+            double run = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            seconds = i == 0 ? run : std::min(seconds, run);
+        }
+        std::cout << "tune\t" << cp_tune_name(variant) << "\t" << std::fixed << std::setprecision(3) << seconds << std::endl;
+        if (variant == 0 || seconds < bestSeconds) {
+            best = variant;
+            bestSeconds = seconds;
+        }
+    }
+    cp_tune_select(best);
+    cp_tune_save(best, cp_tune_file());
+    std::cout << "best\t" << cp_tune_name(best) << "\t" << cp_tune_file() << std::endl;
+}
+#endif
+
 int main(int argc, const char** argv) {
-    if (argc < 3 || argc > 4) {
-        error("usage: cp-benchmark Y X [ITERATIONS]");
+    const char* input = nullptr;
+    const char* output = nullptr;
+#ifdef CP_EXTENDED_API
+    const char* stream = nullptr;
+    bool tune = false;
+#endif
+    if (argc >= 3 && std::string(argv[1]) == "-i") {
+        input = argv[2];
+        argc -= 2;
+        argv += 2;
+    } else if (argc >= 3 && std::string(argv[1]) == "-g") {
+        output = argv[2];
+        argc -= 2;
+        argv += 2;
+#ifdef CP_EXTENDED_API
+    } else if (argc >= 3 && std::string(argv[1]) == "-o") {
+        stream = argv[2];
+        argc -= 2;
+        argv += 2;
+    } else if (argc >= 2 && std::string(argv[1]) == "-t") {
+        tune = true;
+        argc -= 1;
+        argv += 1;
+#endif
+    }
+    if (input != nullptr) {
+        if (argc > 2) {
+            error("usage: cp-benchmark -i FILE [ITERATIONS]");
+        }
+        //the mapped rows go to correlate() as they are
+        MappedMatrix m;
+        read_matrix(m, input);
+        int iter = argc == 2 ? std::stoi(argv[1]) : 1;
+        for (int i = 0; i < iter; ++i) {
+            benchmark_data(m.ny, m.nx, m.data);
+        }
+        return 0;
+    }
+    if (argc < 3 || argc > 4 || (output != nullptr && argc != 3)) {
+#ifdef CP_EXTENDED_API
+        error("usage: cp-benchmark [-o FILE | -t] Y X [ITERATIONS]\n"
+              "       cp-benchmark -g FILE Y X\n"
+              "       cp-benchmark -i FILE [ITERATIONS]");
+#else
+        error("usage: cp-benchmark Y X [ITERATIONS]\n"
+              "       cp-benchmark -g FILE Y X\n"
+              "       cp-benchmark -i FILE [ITERATIONS]");
+#endif
     }
     int ny = std::stoi(argv[1]);
     int nx = std::stoi(argv[2]);
     int iter = argc == 4 ? std::stoi(argv[3]) : 1;
+    if (output != nullptr) {
+        generate_file(ny, nx, output);
+        return 0;
+    }
+#ifdef CP_EXTENDED_API
+    if (tune) {
+        autotune(ny, nx, iter);
+        return 0;
+    }
+#endif
     for (int i = 0; i < iter; ++i) {
+#ifdef CP_EXTENDED_API
+        if (stream) {
+            benchmark_stream(ny, nx, stream);
+            continue;
+        }
+#endif
         benchmark(ny, nx);
     }
 }
@@ -4,6 +4,13 @@
 #include <random>
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <unistd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "cp.h"
 #include "error.h"
@@ -235,16 +242,20 @@ static void print(int ny, int nx, const float *matrix) {
     }
 }
 
-static bool test(int ny, int nx, int mode, bool verbose) {
-    std::vector<float> data(ny * nx);
+static void generate_mode(int ny, int nx, int mode, float* data) {
     switch(mode) {
-        case 0: generate(ny, nx, data.data()); break;
-        case 1: generate_normal(ny, nx, data.data()); break;
-        case 2: generate_subspace(ny, nx, data.data()); break;
-        case 3: generate_measurement(ny, nx, data.data()); break;
-        case 4: generate_special(ny, nx, data.data()); break;
+        case 0: generate(ny, nx, data); break;
+        case 1: generate_normal(ny, nx, data); break;
+        case 2: generate_subspace(ny, nx, data); break;
+        case 3: generate_measurement(ny, nx, data); break;
+        case 4: generate_special(ny, nx, data); break;
         default: error("unknown MODE");
     }
+}
+
+static bool test(int ny, int nx, int mode, bool verbose) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
     std::vector<float> result(ny * ny);
     correlate(ny, nx, data.data(), result.data());
 
@@ -283,6 +294,653 @@ static bool test(int ny, int nx, int mode, bool verbose) {
     return pass;
 }
 
+#ifdef CP_EXTENDED_API
+// Checks the sparse output modes against the dense result.
+static bool test_sparse(int ny, int nx, int mode) {
+    const float threshold = 0.5f;
+    const int k = 5;
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate(ny, nx, data.data(), result.data());
+
+    std::vector<cp_pair> pairs;
+    correlate_threshold(ny, nx, data.data(), threshold, pairs);
+    std::size_t expected = 0;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = j + 1; i < ny; ++i) {
+            expected += std::abs(result[i + ny * j]) >= threshold;
+        }
+    }
+    bool pass = pairs.size() == expected;
+    for (const cp_pair& p : pairs) {
+        pass = pass && p.j < p.i && p.value == result[p.i + ny * p.j]
+            && std::abs(p.value) >= threshold;
+    }
+
+    std::vector<cp_pair> top(ny * k);
+    correlate_topk(ny, nx, data.data(), k, top.data());
+    for (int i = 0; i < ny; ++i) {
+        std::vector<float> strengths;
+        for (int j = 0; j < ny; ++j) {
+            if (j != i) {
+                strengths.push_back(std::abs(result[std::max(i, j) + ny * std::min(i, j)]));
+            }
+        }
+        std::sort(strengths.rbegin(), strengths.rend());
+        for (int t = 0; t < k; ++t) {
+            const cp_pair& p = top[i * k + t];
+            if (t < (int)strengths.size()) {
+                pass = pass && p.i == i && p.j >= 0 && p.j != i
+                    && std::abs(p.value) == strengths[t]
+                    && p.value == result[std::max(i, p.j) + ny * std::min(i, p.j)];
+            } else {
+                pass = pass && p.j == -1;
+            }
+        }
+    }
+    return pass;
+}
+
+// Block sizes for the out-of-core modes: less than one tile, a size that
+// ny is not a multiple of, and more than ny.
+static const int stream_block_sizes[] = {1, 30, 1000};
+
+struct stream_check {
+    int ny;
+    const std::vector<float>* expected;
+    int next_j0;
+    int next_i0;
+    bool pass;
+};
+
+// Compares one block of correlate_stream() with the dense result and
+// checks that the blocks come in row-major block order.
+static void check_stream_block(int j0, int i0, int nj, int ni, const float* block, int ld, void* user) {
+    stream_check& check = *static_cast<stream_check*>(user);
+    const int ny = check.ny;
+    bool pass = j0 == check.next_j0 && i0 == check.next_i0 && j0 <= i0
+        && nj == std::min(ld, ny - j0) && ni == std::min(ld, ny - i0);
+    for (int j = 0; j < nj; ++j) {
+        for (int i = std::max(0, j0 + j - i0); i < ni; ++i) {
+            pass = pass && block[i + j * ld] == (*check.expected)[i0 + i + ny * (j0 + j)];
+        }
+    }
+    check.pass = check.pass && pass;
+    check.next_i0 = i0 + ld < ny ? i0 + ld : j0 + ld;
+    check.next_j0 = i0 + ld < ny ? j0 : j0 + ld;
+}
+
+// Checks the blocks of correlate_stream() against correlate().
+static bool test_stream(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> expected(ny * ny);
+    correlate(ny, nx, data.data(), expected.data());
+
+    bool pass = true;
+    for (int blockSize : stream_block_sizes) {
+        stream_check check = {ny, &expected, 0, 0, true};
+        correlate_stream(ny, nx, data.data(), blockSize, check_stream_block, &check);
+        //every block was seen once the next one would start past ny
+        pass = pass && check.pass && check.next_j0 >= ny;
+    }
+    return pass;
+}
+
+// Checks the file written by correlate_to_file() against correlate().
+static bool test_to_file(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> expected(ny * ny);
+    correlate(ny, nx, data.data(), expected.data());
+
+    bool pass = true;
+    for (int blockSize : stream_block_sizes) {
+        char filename[] = "/tmp/cp-test-XXXXXX";
+        int fd = mkstemp(filename);
+        if (fd < 0) {
+            error("cannot create a temporary file");
+        }
+        close(fd);
+        correlate_to_file(ny, nx, data.data(), filename, blockSize);
+        std::vector<float> result(ny * ny + 1);
+        std::ifstream file(filename, std::ios::binary);
+        file.read(reinterpret_cast<char*>(result.data()), sizeof(float) * result.size());
+        pass = pass && file.gcount() == (std::streamsize)(sizeof(float) * ny * ny);
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                pass = pass && result[i + ny * j] == expected[i + ny * j];
+            }
+        }
+        unlink(filename);
+    }
+    return pass;
+}
+
+// Checks that appending rows in chunks reproduces the dense result.
+static bool test_incremental(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate(ny, nx, data.data(), result.data());
+
+    bool pass = true;
+    cp_incremental* incremental = cp_incremental_create(nx);
+    for (int m = 0, chunk = 1; m < ny; m += chunk, chunk *= 3) {
+        int add = std::min(chunk, ny - m);
+        int n = m + add;
+        std::vector<float> strip(add * n);
+        cp_incremental_append(incremental, add, data.data() + m * nx, strip.data());
+        pass = pass && cp_incremental_rows(incremental) == n;
+        for (int k = 0; k < add; ++k) {
+            for (int j = 0; j <= m + k; ++j) {
+                pass = pass && strip[j + k * n] == result[m + k + ny * j];
+            }
+        }
+    }
+    cp_incremental_destroy(incremental);
+    return pass;
+}
+
+// Checks an append after nOld rows, a count that is not a multiple of the
+// tile width, on several threads: the strip then starts in the middle of
+// a register tile, which must not run into the columns of another thread.
+static bool test_incremental_unaligned(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate(ny, nx, data.data(), result.data());
+
+#ifdef _OPENMP
+    const int nThreads = omp_get_max_threads();
+    omp_set_num_threads(4);
+#endif
+    const int nOld = 37;
+    cp_incremental* incremental = cp_incremental_create(nx);
+    std::vector<float> strip(nOld * nOld);
+    cp_incremental_append(incremental, nOld, data.data(), strip.data());
+    strip.assign((ny - nOld) * ny, 0.0f);
+    cp_incremental_append(incremental, ny - nOld, data.data() + nOld * nx, strip.data());
+    cp_incremental_destroy(incremental);
+#ifdef _OPENMP
+    omp_set_num_threads(nThreads);
+#endif
+
+    bool pass = true;
+    for (int k = 0; k < ny - nOld; ++k) {
+        for (int j = 0; j <= nOld + k; ++j) {
+            pass = pass && strip[j + k * ny] == result[nOld + k + ny * j];
+        }
+    }
+    return pass;
+}
+
+// Checks a rolling window of nx samples over 2 * nx samples against
+// correlate() on every window.
+static bool test_rolling(int ny, int nx, int mode) {
+    const int nt = 2 * nx;
+    const int step = 3;
+    std::vector<float> series(ny * nt);
+    generate_mode(ny, nt, mode, series.data());
+    auto window = [&](int t0) {
+        std::vector<float> data(ny * nx);
+        for (int y = 0; y < ny; ++y) {
+            std::copy_n(series.begin() + t0 + y * nt, nx, data.begin() + y * nx);
+        }
+        return data;
+    };
+
+    bool pass = true;
+    std::vector<float> result(ny * ny);
+    std::vector<float> expected(ny * ny);
+    cp_rolling* rolling = cp_rolling_create(ny, nx, 4);
+    cp_rolling_start(rolling, window(0).data(), result.data());
+    for (int t = step; t + nx <= nt; t += step) {
+        std::vector<float> incoming(ny * step);
+        for (int y = 0; y < ny; ++y) {
+            std::copy_n(series.begin() + t + nx - step + y * nt, step, incoming.begin() + y * step);
+        }
+        cp_rolling_advance(rolling, step, incoming.data(), result.data());
+        correlate(ny, nx, window(t).data(), expected.data());
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                pass = pass && std::abs(result[i + ny * j] - expected[i + ny * j]) < 1e-4;
+            }
+        }
+    }
+    cp_rolling_destroy(rolling);
+    return pass;
+}
+#endif
+
+#ifdef CP_EXTENDED_API
+// Measures the error of the approximate mode against the exact result
+// and checks it against the documented bound.
+static bool test_approx(cp_precision precision, int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate_approx(ny, nx, data.data(), result.data(), precision);
+    float max_error = verify(ny, nx, data.data(), result.data());
+    float bound = cp_approx_bound(precision) + allowed_error;
+    std::cout << std::scientific << std::setprecision(2)
+        << max_error << '\t' << bound << '\t';
+    return max_error <= bound;
+}
+
+static bool test_approx_bf16(int ny, int nx, int mode) {
+    return test_approx(cp_bf16, ny, nx, mode);
+}
+
+static bool test_approx_fp16(int ny, int nx, int mode) {
+    return test_approx(cp_fp16, ny, nx, mode);
+}
+
+// Checks every coefficient of the quantized mode against its documented
+// error bound, and reports the largest error.
+static bool test_int8(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate_int8(ny, nx, data.data(), result.data());
+
+    std::vector<pfloat> normalized(ny * nx);
+    std::vector<pfloat> scale(ny);
+    std::vector<pfloat> norm1(ny);
+    for (int j = 0; j < ny; ++j) {
+        pfloat s = 0.0;
+        pfloat ss = 0.0;
+        for (int i = 0; i < nx; ++i) {
+            pfloat x = data[j * nx + i];
+            s += x;
+            ss += x * x;
+        }
+        pfloat mean = s / nx;
+        pfloat mult = 1.0 / (pfloat) std::sqrt((long double) (ss - s*mean));
+        scale[j] = 0.0;
+        norm1[j] = 0.0;
+        for (int i = 0; i < nx; ++i) {
+            normalized[j * nx + i] = (data[j * nx + i] - mean) * mult;
+            scale[j] = std::max(scale[j], std::fabs(normalized[j * nx + i]) / 127);
+            norm1[j] += std::fabs(normalized[j * nx + i]);
+        }
+    }
+
+    bool pass = true;
+    double max_error = 0.0;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = j; i < ny; ++i) {
+            pfloat exact = 0.0;
+            for (int x = 0; x < nx; ++x) {
+                exact += normalized[j * nx + x] * normalized[i * nx + x];
+            }
+            double error = std::fabs(result[i + ny * j] - exact);
+            double bound = (scale[j] * norm1[i] + scale[i] * norm1[j]) / 2 + nx * scale[i] * scale[j] / 4 + allowed_error;
+            pass = pass && error <= bound;
+            max_error = std::max(max_error, error);
+        }
+    }
+    std::cout << std::scientific << std::setprecision(2) << max_error << '\t';
+    return pass;
+}
+
+// Checks the sketch mode against the exact result, with the sketch size
+// chosen for a tolerance of 0.1.
+static bool test_sketch(int ny, int nx, int mode) {
+    const float tolerance = 0.1f;
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    int m = cp_sketch_size(ny, nx, tolerance);
+    correlate_sketch(ny, nx, data.data(), result.data(), m);
+    float max_error = verify(ny, nx, data.data(), result.data());
+    std::cout << m << '\t' << std::scientific << std::setprecision(2) << max_error << '\t';
+    return max_error <= tolerance;
+}
+
+// Checks that correlate_sketch() takes sketch sizes m < 1 as 1.
+static bool test_sketch_degenerate(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> expected(ny * ny);
+    correlate_sketch(ny, nx, data.data(), expected.data(), 1);
+    bool pass = true;
+    for (int m : {0, -5}) {
+        std::vector<float> result(ny * ny);
+        correlate_sketch(ny, nx, data.data(), result.data(), m);
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                float a = result[i + ny * j];
+                float b = expected[i + ny * j];
+                pass = pass && (a == b || (std::isnan(a) && std::isnan(b)));
+            }
+        }
+    }
+    return pass;
+}
+
+// Checks the rank mode against the Pearson correlation of the ranks, on
+// data rounded to tenths so that the rows have many ties.
+static bool test_spearman(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    for (float& v : data) {
+        v = std::round(v * 10) / 10;
+    }
+    std::vector<float> ranks(ny * nx);
+    for (int y = 0; y < ny; ++y) {
+        const float* row = data.data() + y * nx;
+        for (int x = 0; x < nx; ++x) {
+            int below = 0;
+            int equal = 0;
+            for (int t = 0; t < nx; ++t) {
+                below += row[t] < row[x];
+                equal += row[t] == row[x];
+            }
+            ranks[x + y * nx] = below + (equal + 1) / 2.0f;
+        }
+    }
+    std::vector<float> result(ny * ny);
+    correlate_spearman(ny, nx, data.data(), result.data());
+    float max_error = verify(ny, nx, ranks.data(), result.data());
+    std::cout << std::scientific << std::setprecision(2) << max_error << '\t';
+    return max_error < allowed_error;
+}
+
+// Checks the full output mode: the upper triangle against the exact
+// result and the lower one against the upper one.
+static bool test_full(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    correlate_full(ny, nx, data.data(), result.data());
+    float max_error = verify(ny, nx, data.data(), result.data());
+    bool pass = max_error < allowed_error;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = 0; i < j; ++i) {
+            pass = pass && result[i + ny * j] == result[j + ny * i];
+        }
+    }
+    return pass;
+}
+
+// Checks the zero-copy mode on an aligned padded buffer and on one that
+// is one float off alignment against correlate().
+static bool test_padded(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> expected(ny * ny);
+    correlate(ny, nx, data.data(), expected.data());
+
+    const std::size_t stride = cp_padded_stride(nx);
+    const std::size_t floats = cp_padded_rows(ny) * stride;
+    bool pass = stride >= (std::size_t)nx;
+    for (int offset : {0, 1}) {
+        std::vector<float> buffer(floats + 16 + offset);
+        float* padded = buffer.data();
+        while ((reinterpret_cast<std::uintptr_t>(padded) + offset * sizeof(float)) % 64 != 0) {
+            ++padded;
+        }
+        padded += offset;
+        for (int y = 0; y < ny; ++y) {
+            std::copy_n(data.begin() + y * nx, nx, padded + y * stride);
+        }
+        std::vector<float> result(ny * ny);
+        correlate_padded(ny, nx, padded, result.data());
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                pass = pass && result[i + ny * j] == expected[i + ny * j];
+            }
+        }
+    }
+    return pass;
+}
+
+// Checks one plan executed twice, on two different data sets, against
+// correlate() on each, so that nothing the plan keeps between runs goes
+// stale.
+static bool test_plan(int ny, int nx, int mode) {
+    cp_plan* plan = cp_plan_create(ny, nx);
+    bool pass = plan != nullptr;
+    for (int run = 0; run < 2 && pass; ++run) {
+        std::vector<float> data(ny * nx);
+        generate_mode(ny, nx, mode, data.data());
+        if (run == 1) {
+            std::reverse(data.begin(), data.end());
+        }
+        std::vector<float> expected(ny * ny);
+        correlate(ny, nx, data.data(), expected.data());
+        std::vector<float> result(ny * ny);
+        cp_plan_execute(plan, data.data(), result.data());
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                pass = pass && result[i + ny * j] == expected[i + ny * j];
+            }
+        }
+    }
+    cp_plan_destroy(plan);
+    return pass;
+}
+
+// Checks a batch of jobs of mixed sizes, one of them much larger than the
+// others, against correlate() on every job.
+static bool test_batch(int ny, int nx, int mode) {
+    std::vector<int> nys = {ny, 2, 1, 40, ny, 0, 3 * ny, 17};
+    std::vector<std::vector<float>> data(nys.size());
+    std::vector<std::vector<float>> results(nys.size());
+    std::vector<cp_job> jobs;
+    for (std::size_t t = 0; t < nys.size(); ++t) {
+        int jobNx = nx + t;
+        data[t].resize(nys[t] * jobNx);
+        generate_mode(nys[t], jobNx, mode, data[t].data());
+        results[t].resize(nys[t] * nys[t]);
+        jobs.push_back({nys[t], jobNx, data[t].data(), results[t].data()});
+    }
+    correlate_batch(jobs.size(), jobs.data());
+    bool pass = true;
+    for (const cp_job& job : jobs) {
+        std::vector<float> expected(job.ny * job.ny);
+        correlate(job.ny, job.nx, job.data, expected.data());
+        for (int j = 0; j < job.ny; ++j) {
+            for (int i = j; i < job.ny; ++i) {
+                pass = pass && job.result[i + job.ny * j] == expected[i + job.ny * j];
+            }
+        }
+    }
+    return pass;
+}
+
+// Checks the sharded mode with one and with several workers against
+// correlate().
+static bool test_sharded(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> expected(ny * ny);
+    correlate(ny, nx, data.data(), expected.data());
+    bool pass = true;
+    for (int nWorkers : {1, 3}) {
+        std::vector<float> result(ny * ny);
+        correlate_sharded(ny, nx, data.data(), result.data(), nWorkers);
+        for (int j = 0; j < ny; ++j) {
+            for (int i = j; i < ny; ++i) {
+                pass = pass && result[i + ny * j] == expected[i + ny * j];
+            }
+        }
+    }
+    return pass;
+}
+
+// Checks result and counts of correlate_nan() on data against
+// pairwise-complete correlations in long double, and adds the largest
+// error to max_error.
+static bool check_nan(int ny, int nx, const float* data, const float* result, const int* counts, double& max_error) {
+    bool pass = true;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = j; i < ny; ++i) {
+            const float* a = &data[j * nx];
+            const float* b = &data[i * nx];
+            int n = 0;
+            pfloat sa = 0.0, sb = 0.0;
+            for (int x = 0; x < nx; ++x) {
+                if (a[x] == a[x] && b[x] == b[x]) {
+                    ++n;
+                    sa += a[x];
+                    sb += b[x];
+                }
+            }
+            pfloat ab = 0.0, aa = 0.0, bb = 0.0;
+            for (int x = 0; x < nx; ++x) {
+                if (a[x] == a[x] && b[x] == b[x]) {
+                    ab += (a[x] - sa / n) * (b[x] - sb / n);
+                    aa += (a[x] - sa / n) * (a[x] - sa / n);
+                    bb += (b[x] - sb / n) * (b[x] - sb / n);
+                }
+            }
+            pass = pass && counts[i + ny * j] == n;
+            float q = result[i + ny * j];
+            if (n < 2) {
+                pass = pass && q != q;
+            } else {
+                max_error = std::max(max_error, (double)std::fabs(q - ab / std::sqrt(aa * bb)));
+            }
+        }
+    }
+    return pass;
+}
+
+// Checks the missing-data mode against pairwise-complete correlations in
+// long double, with about a tenth of the elements missing, and checks
+// that it matches correlate() without missing elements.
+static bool test_nan(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    std::vector<int> counts(ny * ny);
+    std::vector<float> dense(ny * ny);
+    correlate(ny, nx, data.data(), dense.data());
+    correlate_nan(ny, nx, data.data(), result.data(), counts.data());
+    bool pass = true;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = j; i < ny; ++i) {
+            pass = pass && result[i + ny * j] == dense[i + ny * j] && counts[i + ny * j] == nx;
+        }
+    }
+
+    std::mt19937 rng;
+    std::bernoulli_distribution coin(0.1);
+    for (float& v : data) {
+        if (coin(rng)) {
+            v = NAN;
+        }
+    }
+    correlate_nan(ny, nx, data.data(), result.data(), counts.data());
+    double max_error = 0.0;
+    pass = check_nan(ny, nx, data.data(), result.data(), counts.data(), max_error) && pass;
+    std::cout << std::scientific << std::setprecision(2) << max_error << '\t';
+    return pass && max_error < allowed_error;
+}
+
+// Checks the missing-data mode with structured missingness: the first
+// half of every row is offset by 100, and the odd rows miss the second
+// half. The even rows share only the offset half with the odd rows, where
+// their mean is far from that of the whole row, so at most those pairs
+// are recomputed from the rows.
+static bool test_nan_structured(int ny, int nx, int mode) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    for (int y = 0; y < ny; ++y) {
+        for (int x = 0; x < nx; ++x) {
+            float& v = data[x + y * nx];
+            v = x < nx / 2 ? v + 100.0f : y % 2 ? NAN : v;
+        }
+    }
+    std::vector<float> result(ny * ny);
+    std::vector<int> counts(ny * ny);
+    correlate_nan(ny, nx, data.data(), result.data(), counts.data());
+    double max_error = 0.0;
+    bool pass = check_nan(ny, nx, data.data(), result.data(), counts.data(), max_error);
+    long long rescans = correlate_nan_rescans();
+    std::cout << rescans << '\t' << std::scientific << std::setprecision(2) << max_error << '\t';
+    return pass && rescans > 0 && rescans <= (long long)(ny - ny / 2) * (ny / 2) && max_error < allowed_error;
+}
+
+// Checks pairwise<Metric> against the metric computed in long double,
+// with metric(exact rows) and the scale its rounding error is relative
+// to.
+template <typename Metric, typename Reference>
+static bool test_pairwise(int ny, int nx, int mode, const Reference& reference) {
+    std::vector<float> data(ny * nx);
+    generate_mode(ny, nx, mode, data.data());
+    std::vector<float> result(ny * ny);
+    pairwise<Metric>(ny, nx, data.data(), result.data());
+
+    double max_error = 0.0;
+    for (int j = 0; j < ny; ++j) {
+        for (int i = j; i < ny; ++i) {
+            pfloat scale = 0.0;
+            pfloat exact = reference(&data[j * nx], &data[i * nx], nx, scale);
+            double error = std::fabs(result[i + ny * j] - exact) / scale;
+            if (error != error) {
+                error = INFINITY;
+            }
+            max_error = std::max(max_error, error);
+        }
+    }
+    std::cout << std::scientific << std::setprecision(2) << max_error << '\t';
+    return max_error < allowed_error;
+}
+
+static pfloat mean_of(const float* a, int nx) {
+    pfloat s = 0.0;
+    for (int x = 0; x < nx; ++x) {
+        s += a[x];
+    }
+    return s / nx;
+}
+
+static bool test_covariance(int ny, int nx, int mode) {
+    return test_pairwise<cp_covariance>(ny, nx, mode, [](const float* a, const float* b, int nx, pfloat& scale) {
+        pfloat ma = mean_of(a, nx);
+        pfloat mb = mean_of(b, nx);
+        pfloat ab = 0.0, aa = 0.0, bb = 0.0;
+        for (int x = 0; x < nx; ++x) {
+            ab += (a[x] - ma) * (b[x] - mb);
+            aa += (a[x] - ma) * (a[x] - ma);
+            bb += (b[x] - mb) * (b[x] - mb);
+        }
+        scale = std::sqrt(aa * bb) / (nx - 1);
+        return ab / (nx - 1);
+    });
+}
+
+static bool test_cosine(int ny, int nx, int mode) {
+    return test_pairwise<cp_cosine>(ny, nx, mode, [](const float* a, const float* b, int nx, pfloat& scale) {
+        pfloat ab = 0.0, aa = 0.0, bb = 0.0;
+        for (int x = 0; x < nx; ++x) {
+            ab += (pfloat)a[x] * b[x];
+            aa += (pfloat)a[x] * a[x];
+            bb += (pfloat)b[x] * b[x];
+        }
+        scale = 1.0;
+        return ab / std::sqrt(aa * bb);
+    });
+}
+
+static bool test_euclidean(int ny, int nx, int mode) {
+    return test_pairwise<cp_euclidean>(ny, nx, mode, [](const float* a, const float* b, int nx, pfloat& scale) {
+        pfloat dd = 0.0, aa = 0.0, bb = 0.0;
+        for (int x = 0; x < nx; ++x) {
+            dd += ((pfloat)a[x] - b[x]) * ((pfloat)a[x] - b[x]);
+            aa += (pfloat)a[x] * a[x];
+            bb += (pfloat)b[x] * b[x];
+        }
+        scale = aa + bb;
+        return dd;
+    });
+}
+#endif
+
 static bool has_fails = false;
 static struct { int ny; int nx; int mode; } first_fail = {};
 static int passcount = 0;
@@ -308,6 +966,27 @@ static void run_test(int ny, int nx, int mode, bool verbose) {
     testcount++;
 }
 
+#ifdef CP_EXTENDED_API
+static void run_extended_test(const char* name, bool (*check)(int, int, int), int ny, int nx, int mode) {
+    std::cout << "cp-test " << name << ' '
+        << std::setw(4) << ny << ' '
+        << std::setw(4) << nx << ' '
+        << std::setw(1) << mode << ' '
+        << std::flush;
+    bool pass = check(ny, nx, mode);
+    std::cout << (pass ? "OK\n" : "ERR\n");
+    if(pass) {
+        passcount++;
+    } else if(!has_fails) {
+        has_fails = true;
+        first_fail.ny = ny;
+        first_fail.nx = nx;
+        first_fail.mode = mode;
+    }
+    testcount++;
+}
+#endif
+
 int main(int argc, const char** argv) {
     if(argc == 1) {
         for(int ny=2; ny<10; ny++)
@@ -326,6 +1005,105 @@ int main(int argc, const char** argv) {
         for(int nx=100; nx<108; nx++)
             run_test(ny, nx, 2, false);
 
+        //rows long enough for cache-blocked implementations to split them
+        for(int ny : {5, 100, 201})
+        for(int mode : modes)
+            run_test(ny, 5000, mode, false);
+
+#ifdef CP_EXTENDED_API
+        for(int ny : {2, 7, 100, 201})
+        for(int mode : modes) {
+            run_extended_test("sparse", test_sparse, ny, 50, mode);
+            run_extended_test("incremental", test_incremental, ny, 50, mode);
+            run_extended_test("rolling", test_rolling, ny, 50, mode);
+        }
+        for(int ny : {100, 201})
+        for(int mode : modes)
+            run_extended_test("incremental-unaligned", test_incremental_unaligned, ny, 1000, mode);
+        for(int mode : modes)
+            run_extended_test("sparse", test_sparse, 100, 5000, mode);
+
+        for(int ny : {0, 1, 7, 100, 201})
+        for(int nx : {50, 1000})
+        for(int mode : modes) {
+            run_extended_test("stream", test_stream, ny, nx, mode);
+            run_extended_test("to_file", test_to_file, ny, nx, mode);
+        }
+
+        for(int ny : {7, 100})
+        for(int nx : {50, 1000})
+        for(int mode : modes) {
+            run_extended_test("bf16", test_approx_bf16, ny, nx, mode);
+            run_extended_test("fp16", test_approx_fp16, ny, nx, mode);
+            run_extended_test("int8", test_int8, ny, nx, mode);
+        }
+
+        for(int ny : {7, 30})
+        for(int nx : {50, 50000})
+        for(int mode : modes)
+            run_extended_test("sketch", test_sketch, ny, nx, mode);
+        for(int mode : modes)
+            run_extended_test("sketch", test_sketch_degenerate, 7, 50, mode);
+
+        for(int ny : {7, 100})
+        for(int nx : {50, 1000})
+        for(int mode : modes)
+            run_extended_test("spearman", test_spearman, ny, nx, mode);
+
+        for(int ny : {1, 7, 100, 300})
+        for(int nx : {50, 1000})
+        for(int mode : modes)
+            run_extended_test("full", test_full, ny, nx, mode);
+
+        for(int ny : {1, 7, 100})
+        for(int nx : {50, 80, 5000})
+        for(int mode : modes)
+            run_extended_test("padded", test_padded, ny, nx, mode);
+
+        //short rows and long rows on the packed path
+        for(int ny : {1, 7, 100})
+        for(int nx : {50, 5000})
+        for(int mode : modes)
+            run_extended_test("plan", test_plan, ny, nx, mode);
+
+        for(int ny : {5, 100})
+        for(int nx : {50, 1000})
+        for(int mode : modes)
+            run_extended_test("batch", test_batch, ny, nx, mode);
+
+        for(int ny : {1, 7, 100, 201})
+        for(int mode : modes)
+            run_extended_test("sharded", test_sharded, ny, 100, mode);
+
+        for(int ny : {2, 7, 100})
+        for(int nx : {3, 50, 1000})
+        for(int mode : modes)
+            run_extended_test("nan", test_nan, ny, nx, mode);
+
+        for(int ny : {2, 7, 100})
+        for(int mode : modes)
+            run_extended_test("nan-structured", test_nan_structured, ny, 1000, mode);
+
+        for(int ny : {7, 100})
+        for(int nx : {50, 5000})
+        for(int mode : modes) {
+            run_extended_test("covariance", test_covariance, ny, nx, mode);
+            run_extended_test("cosine", test_cosine, ny, nx, mode);
+            run_extended_test("euclidean", test_euclidean, ny, nx, mode);
+        }
+
+        //every tunable kernel variant, on short and on blocked long rows,
+        //then back to the tuned one for the tests after these
+        const int tuned = cp_tune_current();
+        for(int variant = 0; variant < cp_tune_variants(); ++variant) {
+            cp_tune_select(variant);
+            for(int ny : {7, 100})
+            for(int nx : {50, 5000})
+                run_test(ny, nx, 2, false);
+        }
+        cp_tune_select(tuned);
+#endif
+
         if(STRICT_PRECISION) {
             int mode = 4;
             for(int x=2; x < 100; x*=3) {
@@ -0,0 +1,70 @@
+#ifndef NORMALIZE_H
+#define NORMALIZE_H
+
+#include <cmath>
+#include "vector.h"
+
+// Sums of one input row of nx elements and of their squares, both
+// accumulated in double and shifted by the first element so that a large
+// mean does not cancel the variance: the row is row[x] = shift + v[x],
+// sum is the sum of the v[x] and square the sum of their squares.
+struct row_moments {
+    double shift;
+    double sum;
+    double square;
+};
+
+inline row_moments moments_of_row(const float* row, int nx) {
+    const double shift = nx > 0 ? row[0] : 0.0;
+    double4_t sums[2] = {double4_0, double4_0};
+    double4_t squares[2] = {double4_0, double4_0};
+    int x = 0;
+    for (; x + 8 <= nx; x += 8) {
+        for (int i = 0; i < 2; ++i) {
+            const float* p = row + x + 4 * i;
+            double4_t v = {p[0] - shift, p[1] - shift, p[2] - shift, p[3] - shift};
+            sums[i] += v;
+            squares[i] += v * v;
+        }
+    }
+    double sum = 0.0;
+    double square = 0.0;
+    for (; x < nx; ++x) {
+        double v = row[x] - shift;
+        sum += v;
+        square += v * v;
+    }
+    for (int i = 0; i < 4; ++i) {
+        sum += sums[0][i] + sums[1][i];
+        square += squares[0][i] + squares[1][i];
+    }
+    return {shift, sum, square};
+}
+
+// Writes (row[x] - mean) * scale to out, followed by zeros up to nPadded
+// elements. Real is the element type of the padded layout, e.g. float for
+// float8_t rows.
+template <typename Real>
+inline void scale_row(const float* row, int nx, double mean, double scale, Real* out, int nPadded) {
+    int x = 0;
+    for (; x < nx; ++x) {
+        out[x] = (row[x] - mean) * scale;
+    }
+    for (; x < nPadded; ++x) {
+        out[x] = 0;
+    }
+}
+
+// Normalizes one input row of nx elements to zero mean and unit length,
+// reading the input only once from memory: the moments are computed in
+// one pass, and the row is then still in cache when the normalized values
+// are written to out, followed by zeros up to nPadded elements.
+template <typename Real>
+inline void normalize_row(const float* row, int nx, Real* out, int nPadded) {
+    const row_moments m = moments_of_row(row, nx);
+    const double mean = m.shift + m.sum / nx;
+    const double scale = 1.0 / std::sqrt(m.square - m.sum * m.sum / nx);
+    scale_row(row, nx, mean, scale, out, nPadded);
+}
+
+#endif
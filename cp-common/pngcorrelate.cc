@@ -1,16 +1,47 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include "pngio.h"
+#include "matrixio.h"
 #include "error.h"
 #include "timer.h"
+#include "memory.h"
 #include "cp.h"
 
-static void process_image(const Image8& in, Image8& gray, Image8& out) {
+static bool is_npy(const char* filename) {
+    std::size_t n = std::strlen(filename);
+    return n >= 4 && std::strcmp(filename + n - 4, ".npy") == 0;
+}
+
+#ifdef CP_EXTENDED_API
+//the whole symmetric matrix comes out of the product
+constexpr bool full_result = true;
+#else
+constexpr bool full_result = false;
+#endif
+
+static void correlate_timed(int ny, int nx, const float* data, float* result) {
+    std::cout << "cp\t" << ny << "\t" << nx << "\t" << std::flush;
+#ifdef CP_EXTENDED_API
+    { ppc::timer t; correlate_full(ny, nx, data, result); }
+#else
+    { ppc::timer t; correlate(ny, nx, data, result); }
+#endif
+    std::cout << std::endl;
+    if (!full_result) {
+        //correlate() may leave anything below the diagonal
+        for (int j = 1; j < ny; ++j) {
+            std::fill(result + (std::size_t)ny * j, result + (std::size_t)ny * j + j, 0.0f);
+        }
+    }
+}
+
+static void process_image(const Image8& in, Image8& gray, std::vector<float>& data) {
     int ny = in.ny;
     int nx = in.nx;
     gray.resize(ny, nx, 1);
-    std::vector<float> data(ny * nx);
-    std::vector<float> result(ny * ny);
+    data.resize(ny * nx);
     for (int y = 0; y < in.ny; ++y) {
         for (int x = 0; x < in.nx; ++x) {
             float v = in.getgray(y, x);
@@ -18,13 +49,28 @@ static void process_image(const Image8& in, Image8& gray, Image8& out) {
             gray.setlin(y, x, 0, v);
         }
     }
-    std::cout << "cp\t" << in.ny << "\t" << in.nx << "\t" << std::flush;
-    { ppc::timer t; correlate(ny, nx, data.data(), result.data()); }
-    std::cout << std::endl;
+}
+
+// Shows a matrix that was not read from an image, scaled to the range of
+// its values.
+static void gray_of_matrix(int ny, int nx, const float* data, Image8& gray) {
+    gray.resize(ny, nx, 1);
+    auto range = std::minmax_element(data, data + (std::size_t)ny * nx);
+    float low = ny * nx > 0 ? *range.first : 0.0f;
+    float high = ny * nx > 0 ? *range.second : 0.0f;
+    float scale = high > low ? 1.0f / (high - low) : 0.0f;
+    for (int y = 0; y < ny; ++y) {
+        for (int x = 0; x < nx; ++x) {
+            gray.setlin(y, x, 0, (data[x + (std::size_t)nx * y] - low) * scale);
+        }
+    }
+}
+
+static void result_image(int ny, const float* result, Image8& out) {
     out.resize(ny, ny, 3);
     for (int j = 0; j < ny; ++j) {
         for (int i = 0; i < ny; ++i) {
-            float v = i < j ? result[j + ny * i] : result[i + ny * j];
+            float v = full_result || i >= j ? result[i + ny * j] : result[j + ny * i];
             if (v >= 0) {
                 out.setlin(j, i, 0, 1.0f);
                 out.setlin(j, i, 1, 1.0f - v);
@@ -39,6 +85,11 @@ static void process_image(const Image8& in, Image8& gray, Image8& out) {
     }
 }
 
+// INPUT is a PNG image or a .npy matrix of float32. OUTPUT2 is a PNG
+// image of the result, or a .npy file for the result matrix: the whole
+// symmetric matrix where correlate_full() exists, otherwise the upper
+// triangle from correlate(), with the elements below the diagonal, which
+// correlate() leaves undefined, set to zero.
 int main(int argc, const char** argv) {
     if (argc != 4) {
         error("usage: pngcorrelate INPUT OUTPUT1 OUTPUT2");
@@ -46,11 +97,38 @@ int main(int argc, const char** argv) {
     const char* fin = argv[1];
     const char* fout1 = argv[2];
     const char* fout2 = argv[3];
-    Image8 in;
     Image8 gray;
-    Image8 out;
-    read_image(in, fin);
-    process_image(in, gray, out);
+    std::vector<float> pixels;
+    MappedMatrix matrix;
+    int ny = 0;
+    int nx = 0;
+    const float* data = nullptr;
+    if (is_npy(fin)) {
+        read_matrix(matrix, fin);
+        ny = matrix.ny;
+        nx = matrix.nx;
+        data = matrix.data;
+        gray_of_matrix(ny, nx, data, gray);
+    } else {
+        Image8 in;
+        read_image(in, fin);
+        process_image(in, gray, pixels);
+        ny = in.ny;
+        nx = in.nx;
+        data = pixels.data();
+    }
     write_image(gray, fout1);
-    write_image(out, fout2);
+
+    if (is_npy(fout2)) {
+        //the result is written straight into the mapped output file
+        MappedMatrix result;
+        create_matrix(result, fout2, ny, ny);
+        correlate_timed(ny, nx, data, result.data);
+    } else {
+        ppc::vector<float, ppc::cache_line, ppc::placement_huge_pages | ppc::placement_interleave> result((std::size_t)ny * ny);
+        correlate_timed(ny, nx, data, result.data());
+        Image8 out;
+        result_image(ny, result.data(), out);
+        write_image(out, fout2);
+    }
 }
@@ -5,27 +5,12 @@
 #include <cmath>
 #include <vector>
 #include <numeric>
+#include <algorithm>
+#include "normalize.h"
+#include "scheduler.h"
 
-double MeanOfRow(const int& nx, const float* data, const int& y)
-{
-    double mean = 0.;
-    for(int i = 0; i < nx; ++i)
-    {
-	mean += (double)data[i + y * nx];
-    }
-    return mean / (double)nx;
-}
-
-double CalculateDenominator(const int& nx, const int& y, const double* normalized)
-{
-    double denominator = 0.;
-    
-    for(int x = 0; x < nx; ++x)
-    {
-	denominator += pow(normalized[x + y * nx], 2);
-    }
-    return sqrt(denominator);
-}
+//side of the square blocks of the result handed out to the threads
+constexpr int nBlock = 16;
 
 double CalculateSum(const int& nx, const int& y, const int& x, const double* normalized)
 {
@@ -43,37 +28,29 @@ void correlate(int ny, int nx, const float* data, float*result)
     double* normalized = (double*)malloc(sizeof(double) * nx * ny);
     //std::vector<double> normalized(nx * ny);
 
-    //first normalization
+    //normalization
     #pragma omp parallel for
     for(int y = 0; y < ny; ++y)
     {
-	double mean = MeanOfRow(nx, data, y);
-	for(int x = 0; x < nx; ++x)
-	{
-	    normalized[x + y * nx] = (double)(data[x + y * nx]) - mean;
-	}
-    }
-    //second normalization
-    #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
-    {
-	double denominator = CalculateDenominator(nx, y, normalized);
-	for(int x = 0; x < nx; ++x)
-	{
-	    normalized[x + y * nx] /= denominator;
-	}
+	normalize_row(data + y * nx, nx, normalized + y * nx, nx);
     }
 
   
   //Matrix multiplication
-    #pragma omp parallel for schedule(static,1)
-    for(int y = 0; y < ny; ++y)
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, ny, 0, ny, nBlock, nBlock);
+    ppc::parallel_tiles(tiles, [&]()
     {
-	for(int x = y; x < ny; ++x)
+	return [&](const ppc::tile_range& tile)
 	{
-	    double sum = CalculateSum(nx, y, x, normalized);
-	    result[x + y * ny] = (float)sum;
-	}
-    }
+	    for(int y = tile.y0; y < tile.y1; ++y)
+	    {
+		for(int x = std::max(tile.x0, y); x < tile.x1; ++x)
+		{
+		    double sum = CalculateSum(nx, y, x, normalized);
+		    result[x + y * ny] = (float)sum;
+		}
+	    }
+	};
+    });
     free(normalized);
 }
@@ -5,72 +5,15 @@
 #include <vector>
 #include <numeric>
 #include <limits>
+#include <algorithm>
 #include "vector.h"
+#include "normalize.h"
+#include "scheduler.h"
 
 constexpr int nDouble = 4;
 constexpr int nParallelOps = 10;
-
-double MeanOfRow(const int& nx, const double4_t* workingData, const int& y, const int& nVectors, const int& nNewX)
-{
-    double4_t* partialSums = double4_alloc(nParallelOps);
-    double4_t zeroVec = {0., 0., 0., 0.};
-    for(int i = 0; i < nParallelOps; ++i)
-    {
-	partialSums[i] = zeroVec;
-    }
-    for(int x = 0; x < nVectors; x += nParallelOps)
-    {
-	for(int i = 0; i < nParallelOps; ++i)
-	{
-	    partialSums[i] += workingData[x + i + nNewX * y];
-	}
-    }
-
-    double ret = 0.;
-    for(int i = 0; i < nParallelOps; ++i)
-    {
-	for(int j = 0; j < nDouble; ++j)
-	{
-	    ret += partialSums[i][j];
-	}
-    }
-
-    
-
-    free(partialSums);
-    return ret / (double)nx;
-}
-
-double CalculateDenominator(const int& y, const double4_t* workingData, const int& nVectors, const int& nNewX)
-{
-    double4_t* denominators = double4_alloc(nParallelOps);
-    for(int i = 0; i < nParallelOps; ++i)
-    {
-	for(int j = 0; j < nDouble; ++j)
-	{
-	    denominators[i][j] = 0.0;
-	}
-    } 
-
-    for(int x = 0; x < nVectors; x += nParallelOps)
-    {
-	for(int i = 0; i < nParallelOps; ++i)
-	{
-	    denominators[i] += workingData[x + i + y * nNewX] * workingData[x + i + y * nNewX];
-	}
-    }
-
-    double ret = 0.;
-    for(int i = 0; i < nParallelOps; ++i)
-    {
-	for(int j = 0; j < nDouble; ++j)
-	{
-	    ret += denominators[i][j];
-	}
-    }
-    free(denominators);
-    return sqrt(ret);
-}
+//side of the square blocks of the result handed out to the threads
+constexpr int nBlock = 4 * nParallelOps;
 
 void CalculateSum(const int& x, const double4_t* workingData, const int& nNewX, double4_t* partialSums, const int& run, double4_t* reusableCells)
 {
@@ -107,18 +50,11 @@ void correlate(int ny, int nx, const float* data, float*result)
 
     double4_t* workingData = double4_alloc(nNewY * nNewX);
     
-    //copying data to vectors
+    //normalization into the padded vectors
     #pragma omp parallel for
     for(int y = 0; y < ny; ++y)
     {
-        for(int x = 0; x < nNewX; ++x)
-	{
-		for(int actDouble = 0; actDouble < nDouble; ++actDouble)
-		{
-			int actCol = actDouble + x * nDouble;
-	 	        workingData[x + nNewX * y][actDouble] = actCol < nx ? (double)data[y * nx + actCol] : 0.;
-		}
-	}
+	normalize_row(data + y * nx, nx, (double*)(workingData + nNewX * y), nNewX * nDouble);
     }
     double4_t zeroVec = {0., 0., 0., 0.};
     for(int y = ny; y < nNewY; ++y)
@@ -129,39 +65,6 @@ void correlate(int ny, int nx, const float* data, float*result)
 	}
     }
     
-    //first normalization
-    #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
-    {
-        double mean = MeanOfRow(nx, workingData, y, nVectors, nNewX);
-	double4_t meanVec = {mean, mean, mean, mean};
-	
-        for(int actVector = 0; actVector < nVectors - (nx % nDouble == 0 ? 0 : 1); ++actVector)
-	{
-            workingData[actVector + nNewX * y] -= meanVec;
-	}
-	for(int actDouble = 0; actDouble < nx % nDouble; ++actDouble)
-	{
-            workingData[(y + 1) * nNewX - (nNewX - nVectors) - 1][actDouble] -= mean;
-	}
-	
-    }
-    //second normalization
-    #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
-    {
-        double denominator = CalculateDenominator(y, workingData, nVectors, nNewX);
-	double4_t denomVec = { denominator, denominator, denominator, denominator};
-        for(int actVector = 0; actVector < nVectors - (nx % nDouble == 0 ? 0 : 1); ++actVector)
-	{
-            workingData[actVector + nNewX * y] /= denomVec;
-	}
-	for(int actDouble = 0; actDouble < nx % nDouble; ++actDouble)
-	{
-            workingData[(y + 1) * nNewX - (nNewX - nVectors) - 1][actDouble] /= denominator;
-	}
-    }
-
 
     //Matrix multiplication
     
@@ -174,42 +77,46 @@ void correlate(int ny, int nx, const float* data, float*result)
 	}
     }
     
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nBlock, nBlock);
     for(int run = 0; run < nNewX; run += nParallelOps)
     {
-        #pragma omp parallel for schedule(static, 1)
-	for(int y = 0; y < nNewY; y += nParallelOps)
+	ppc::parallel_tiles(tiles, [&]()
 	{
-	    double4_t reusableCells[nParallelOps * nParallelOps];
-	    std::vector<int> indices;
-	    //copy values to local variable to reuse
-	    for(int row = 0; row < nParallelOps; ++row)
-	    {
-		for(int col = 0; col < nParallelOps; ++col)
-		{
-		    reusableCells[col + row * nParallelOps] = workingData[run + col + (y + row) * nNewX];
-		}
-	    }
-	    for(int x = y; x < nNewY; x += nParallelOps)
+	    return [&](const ppc::tile_range& tile)
 	    {
-		double4_t partialRes[nParallelOps * nParallelOps];
-		CalculateSum(x, workingData,nNewX, partialRes, run, reusableCells);
-		//copy the results to res array
-		for(int i = 0; i < nParallelOps; ++i)
+		for(int y = tile.y0; y < tile.y1; y += nParallelOps)
 		{
-		    for(int j = 0; j < nParallelOps; ++j)
+		    double4_t reusableCells[nParallelOps * nParallelOps];
+		    //copy values to local variable to reuse
+		    for(int row = 0; row < nParallelOps; ++row)
+		    {
+			for(int col = 0; col < nParallelOps; ++col)
+			{
+			    reusableCells[col + row * nParallelOps] = workingData[run + col + (y + row) * nNewX];
+			}
+		    }
+		    for(int x = std::max(tile.x0, y); x < tile.x1; x += nParallelOps)
 		    {
-			double sum = 0.;
-			for(int addParts = 0; addParts < nDouble; ++addParts)
+			double4_t partialRes[nParallelOps * nParallelOps];
+			CalculateSum(x, workingData,nNewX, partialRes, run, reusableCells);
+			//copy the results to res array
+			for(int i = 0; i < nParallelOps; ++i)
 			{
-			    sum += partialRes[j + i * nParallelOps][addParts];
+			    for(int j = 0; j < nParallelOps; ++j)
+			    {
+				double sum = 0.;
+				for(int addParts = 0; addParts < nDouble; ++addParts)
+				{
+				    sum += partialRes[j + i * nParallelOps][addParts];
+				}
+				res[j + x + (y + i) * nNewY] += sum;
+			    }
 			}
-			res[j + x + (y + i) * nNewY] += sum;
 		    }
 		}
-	    }
-	}
+	    };
+	});
     }
-    
     #pragma omp parallel for
     for(int y = 0; y < ny; ++y)
     {
@@ -5,225 +5,2442 @@
 #include <vector>
 #include <numeric>
 #include <limits>
+#include <new>
+#include <algorithm>
+#include <omp.h>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
 #include "vector.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "normalize.h"
+#include "error.h"
 
 constexpr int nFloat = 8;
 constexpr int nParallelOps = 10;
+// Register tiles of the matrix product have one of the shapes of
+// TileKernels(). Every side divides nTilePad, the padding of the rows,
+// and no tile has more than nMaxTileSums accumulators.
+constexpr int nTilePad = 24;
+constexpr int nMaxTileSums = 24;
+// Unit of work of the scheduler: a block of whole register tiles, small
+// enough that the triangle splits into many blocks of equal cost.
+constexpr int nBlockRows = nTilePad;
+constexpr int nBlockCols = nTilePad;
+// Cache blocking of the packed product: the rows of a column panel stay
+// in L1 for one k-block of float8_t, the nPackRows rows of a block in L2
+// and the nPackCols partner rows in L3. Long rows switch to it from
+// nPackMinVectors float8_t on.
+constexpr int nPackRows = 4 * nTilePad;
+constexpr int nPackCols = 8 * nTilePad;
+constexpr int nPackMinVectors = 512;
+// Quantized rows hold int8 in -127...127, so an int32 lane, which adds two
+// products per vector of 16 int8, can sum nInt8Steps vectors exactly.
+constexpr int nInt8Steps = 65536;
+// Register tile of the quantized kernel: nInt8Rows * nInt8Cols int32x8_t
+// accumulators plus nInt8Cols + 1 operands fill the 16 ymm registers.
+constexpr int nInt8Rows = 4;
+constexpr int nInt8Cols = 3;
+// Workspace rows start on cache lines, so they can also be read as
+// float16_t by the 512-bit kernel.
+constexpr std::size_t nAlignment = 64;
+static_assert(nParallelOps % 2 == 0, "rows must hold whole float16_t vectors");
 
-float MeanOfRow(const int& nx, const float8_t* workingData, const int& y, const int& nVectors, const int& nNewX)
+// Sign-extends 16 int8 to int16. It is inlined into every copy of the
+// quantized kernel and compiled with that copy's instruction set.
+inline void WidenInt8(const int8x16_t& source, int16x16_t& out)
 {
-    float8_t* partialSums = float8_alloc(nParallelOps);
-    float8_t zeroVec = {0., 0., 0., 0., 0., 0., 0., 0.};
-    for(int i = 0; i < nParallelOps; ++i)
+    for(int lane = 0; lane < 16; ++lane)
     {
-	partialSums[i] = zeroVec;
+	out[lane] = source[lane];
     }
-    for(int x = 0; x < nVectors; x += nParallelOps)
+}
+
+//one copy of the tile kernel per instruction set, built with the flags of
+//the translation unit (generic) or with wider vectors enabled. Each copy
+//brings its own int16 multiply-add for the quantized kernel: acc plus
+//the sums of adjacent pairs of the products of a and b. The vectors go
+//by reference, as the ABI for 32-byte vectors by value differs with and
+//without AVX.
+namespace generic
+{
+inline void MultiplyAddPairs(int32x8_t& acc, const int16x16_t& a, const int16x16_t& b)
+{
+    for(int lane = 0; lane < 8; ++lane)
     {
-	for(int i = 0; i < nParallelOps; ++i)
-	{
-	    partialSums[i] += workingData[x + i + nNewX * y];
-	}
+	acc[lane] += a[2 * lane] * b[2 * lane] + a[2 * lane + 1] * b[2 * lane + 1];
+    }
+}
+#include "tile.h"
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+namespace avx2
+{
+inline void MultiplyAddPairs(int32x8_t& acc, const int16x16_t& a, const int16x16_t& b)
+{
+    acc += __builtin_ia32_pmaddwd256(a, b);
+}
+#include "tile.h"
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512vl,avx2,fma")
+namespace avx512
+{
+inline void MultiplyAddPairs(int32x8_t& acc, const int16x16_t& a, const int16x16_t& b)
+{
+    acc += __builtin_ia32_pmaddwd256(a, b);
+}
+#include "tile.h"
+}
+#pragma GCC pop_options
+
+//AVX-512 with the fused multiply-add of VNNI, only for the quantized kernel
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512vl,avx512vnni,avx2,fma")
+namespace vnni
+{
+inline void MultiplyAddPairs(int32x8_t& acc, const int16x16_t& a, const int16x16_t& b)
+{
+    acc = __builtin_ia32_vpdpwssd_v8si(acc, (int32x8_t)a, (int32x8_t)b);
+}
+#include "tile.h"
+}
+#pragma GCC pop_options
+
+typedef void (*TileSumsFunction)(const float8_t* rows, const float8_t* cols, int nVectors, int nNewX, float* result);
+typedef void (*PackedTileSumsFunction)(const float8_t* rows, const float8_t* cols, int nSteps, float* result);
+
+// One instruction set's copy of the tile kernels for one tile shape of
+// rows x cols. The packed kernel reads packWidth float8_t of every row per
+// step, over k-blocks of packSteps float8_t.
+struct TileKernel
+{
+    TileSumsFunction sums;
+    PackedTileSumsFunction packedSums;
+    int packWidth;
+    int rows;
+    int cols;
+    int packSteps;
+};
+
+// Picks the widest instruction set the CPU supports: 512-bit vectors with
+// AVX-512, 256-bit ones otherwise. PPC_ISA=generic, avx2 or avx512 in the
+// environment forces a copy, e.g. to compare them.
+std::string SelectIsa()
+{
+    __builtin_cpu_init();
+    const char* forced = std::getenv("PPC_ISA");
+    std::string isa = forced != nullptr ? forced : "";
+    bool hasAvx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl");
+    bool hasAvx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if((isa.empty() || isa == "avx512") && hasAvx512)
+    {
+	return "avx512";
+    }
+    if((isa.empty() || isa == "avx512" || isa == "avx2") && hasAvx2)
+    {
+	return "avx2";
     }
+    return "generic";
+}
+
+const std::string tileIsa = SelectIsa();
+
+// The scheduled products walk their tiles along a Hilbert curve, so that
+// the tiles a thread runs one after the other reuse the same row and
+// column bands from cache. PPC_TILE_ORDER=rows in the environment
+// restores the row band order, e.g. to compare them.
+ppc::tile_order SelectTileOrder()
+{
+    const char* forced = std::getenv("PPC_TILE_ORDER");
+    return forced != nullptr && std::string(forced) == "rows" ? ppc::tile_order::rows : ppc::tile_order::hilbert;
+}
+
+const ppc::tile_order tileOrder = SelectTileOrder();
 
-    float ret = 0.;
-    for(int i = 0; i < nParallelOps; ++i)
+// Adds the kernels of one tile shape for every k-block size.
+template <int Rows, int Cols>
+void AddTileShape(std::vector<TileKernel>& kernels, const std::string& isa)
+{
+    static_assert(nTilePad % Rows == 0 && nTilePad % Cols == 0, "tiles must divide the padding");
+    static_assert(Rows * Cols <= nMaxTileSums, "too many accumulators");
+    for(int packSteps : {256, 128, 512})
     {
-	for(int j = 0; j < nFloat; ++j)
+	if(isa == "avx512")
+	{
+	    kernels.push_back({avx512::TileSumsWide<Rows, Cols>, avx512::PackedTileSumsWide<Rows, Cols>, 2, Rows, Cols, packSteps});
+	}
+	else if(isa == "avx2")
+	{
+	    kernels.push_back({avx2::TileSums<Rows, Cols>, avx2::PackedTileSums<Rows, Cols>, 1, Rows, Cols, packSteps});
+	}
+	else
 	{
-	    ret += partialSums[i][j];
+	    kernels.push_back({generic::TileSums<Rows, Cols>, generic::PackedTileSums<Rows, Cols>, 1, Rows, Cols, packSteps});
 	}
     }
+}
 
-    
-
-    free(partialSums);
-    return ret / (float)nx;
+// All kernel variants of the instruction set that cp_tune_* can choose
+// from, the default first. The accumulators and the operands of one step
+// fit in the 16 ymm registers of AVX2 for 4x3 and 6x2, and in the 32 zmm
+// registers of AVX-512 for the larger shapes.
+std::vector<TileKernel> TileKernels(const std::string& isa)
+{
+    std::vector<TileKernel> kernels;
+    AddTileShape<4, 3>(kernels, isa);
+    AddTileShape<6, 2>(kernels, isa);
+    AddTileShape<4, 4>(kernels, isa);
+    AddTileShape<6, 4>(kernels, isa);
+    AddTileShape<4, 6>(kernels, isa);
+    AddTileShape<8, 3>(kernels, isa);
+    return kernels;
 }
 
-float CalculateDenominator(const int& y, const float8_t* workingData, const int& nVectors, const int& nNewX)
+const std::vector<TileKernel> tileKernels = TileKernels(tileIsa);
+
+// Returns the variant saved in the tuning file for this instruction set,
+// or the default if there is no usable file.
+int LoadTuning(const char* filename)
 {
-    float8_t denominators[nParallelOps];// = float8_alloc(nParallelOps);
-    for(int i = 0; i < nParallelOps; ++i)
+    std::ifstream file(filename);
+    std::string isa;
+    int rows = 0;
+    int cols = 0;
+    int packSteps = 0;
+    if(file >> isa >> rows >> cols >> packSteps && isa == tileIsa)
     {
-	for(int j = 0; j < nFloat; ++j)
+	for(int variant = 0; variant < (int)tileKernels.size(); ++variant)
 	{
-	    denominators[i][j] = 0.0;
+	    const TileKernel& kernel = tileKernels[variant];
+	    if(kernel.rows == rows && kernel.cols == cols && kernel.packSteps == packSteps)
+	    {
+		return variant;
+	    }
 	}
-    } 
+    }
+    return 0;
+}
+
+// The variant in use and its kernel.
+int tileVariant = LoadTuning(cp_tune_file());
+TileKernel tileKernel = tileKernels[tileVariant];
 
-    for(int x = 0; x < nVectors; x += nParallelOps)
+typedef void (*Int8TileSumsFunction)(const int8x16_t* rows, const int8x16_t* cols, int nSteps, int nNewX, float* result);
+
+// The quantized kernel of the selected instruction set, with the fused
+// multiply-add of VNNI where the CPU has it.
+Int8TileSumsFunction SelectInt8TileSums()
+{
+    if(tileIsa == "avx512")
     {
-	for(int i = 0; i < nParallelOps; ++i)
+	if(__builtin_cpu_supports("avx512vnni"))
 	{
-	    denominators[i] += workingData[x + i + y * nNewX] * workingData[x + i + y * nNewX];
+	    return vnni::Int8TileSums<nInt8Rows, nInt8Cols>;
 	}
+	return avx512::Int8TileSums<nInt8Rows, nInt8Cols>;
+    }
+    if(tileIsa == "avx2")
+    {
+	return avx2::Int8TileSums<nInt8Rows, nInt8Cols>;
     }
+    return generic::Int8TileSums<nInt8Rows, nInt8Cols>;
+}
+
+const Int8TileSumsFunction int8TileSums = SelectInt8TileSums();
 
-    float ret = 0.;
-    for(int i = 0; i < nParallelOps; ++i)
+// Dot products of the kernel.rows rows starting at y with the
+// kernel.cols rows starting at x over the whole padded row. Each
+// finished coefficient is handed once to epilogue(j, i, value), where j
+// is the row and i the partner row index.
+template <typename Epilogue>
+void CalculateTile(const TileKernel& kernel, const int& y, const int& x, const float8_t* workingData, const int& nVectors, const int& nNewX, const int& ny, Epilogue& epilogue)
+{
+    float sums[nMaxTileSums];
+    kernel.sums(workingData + y * nNewX, workingData + x * nNewX, nVectors, nNewX, sums);
+    for(int row = 0; row < kernel.rows && y + row < ny; ++row)
     {
-	for(int j = 0; j < nFloat; ++j)
+	for(int col = 0; col < kernel.cols && x + col < ny; ++col)
 	{
-	    ret += denominators[i][j];
+	    epilogue(y + row, x + col, sums[col + row * kernel.cols]);
 	}
     }
-//    free(denominators);
-    return sqrt(ret);
 }
 
-void CalculateSum(const int& x, const float8_t* workingData, const int& nNewX, float8_t* partialSums, const int& run, float8_t* reusableCells)
+// Per-thread buffers of the packed product for nThreads threads and
+// k-blocks of up to nSteps float8_t: the packed row and column panels and
+// the block of tile sums of every thread.
+struct PackScratch
+{
+    int nThreads = 0;
+    int nSteps = 0;
+    ppc::unique_ptr<float8_t> packed;
+    ppc::unique_ptr<float> blockSums;
+};
+
+constexpr std::size_t nPackSums = (std::size_t)nPackRows * nPackCols;
+
+// Allocates scratch for nThreads threads and k-blocks of nSteps. Every
+// thread faults in its own part, so that it lands on the thread's NUMA
+// node and the product runs without page faults.
+void AllocPackScratch(PackScratch& scratch, int nThreads, int nSteps)
 {
-    float8_t zeroVec = {0., 0., 0., 0., 0., 0., 0., 0.};
-    for(int i = 0; i < nParallelOps * nParallelOps; ++i)
+    const std::size_t nPanels = (std::size_t)(nPackRows + nPackCols) * nSteps;
+    scratch.packed = ppc::alloc<float8_t>(nPanels * nThreads, ppc::cache_line);
+    scratch.blockSums = ppc::alloc<float>(nPackSums * nThreads, ppc::cache_line);
+    if(scratch.packed == nullptr || scratch.blockSums == nullptr)
     {
-	    partialSums[i] = zeroVec;
+	throw std::bad_alloc();
     }
-    
-    for(int partialRow = 0; partialRow < nParallelOps; ++partialRow)
+    scratch.nThreads = nThreads;
+    scratch.nSteps = nSteps;
+    #pragma omp parallel num_threads(nThreads)
     {
-	for(int partialCol = 0; partialCol < nParallelOps; ++partialCol)
-	{
-	    for(int i = 0; i < nParallelOps; ++i)
-	    {
-		partialSums[partialCol + partialRow * nParallelOps] +=
-		    reusableCells[i + partialRow * nParallelOps] * workingData[i + run  + (partialCol + x) * nNewX];
-	    }
-	}
+	const int thread = omp_get_thread_num();
+	std::fill(scratch.packed.get() + nPanels * thread, scratch.packed.get() + nPanels * (thread + 1), float8_0);
+	std::fill(scratch.blockSums.get() + nPackSums * thread, scratch.blockSums.get() + nPackSums * (thread + 1), 0.f);
     }
-    
-    int k = 2;
-    k = k + 2;
 }
 
-void correlate(int ny, int nx, const float* data, float*result)
+struct cp_plan
+{
+    int ny;
+    int nx;
+    int nVectors;
+    int nNewX;
+    int nNewY;
+    float8_t* workingData;
+    // Made once by cp_plan_create for the products over the whole upper
+    // triangle, so that executing the plan allocates nothing: the list of
+    // scheduler tiles and, for long rows, the scratch of the packed
+    // product. Empty and null in a bare PlanShape() and for ny == 0.
+    std::vector<ppc::tile_range> tiles;
+    PackScratch* scratch;
+};
+
+// Placement of the workspace: every thread reads every row during the
+// products, so the pages are spread over all NUMA nodes rather than left
+// on the node of the thread that normalized the row.
+constexpr unsigned nWorkspacePlacement = ppc::placement_huge_pages | ppc::placement_interleave;
+
+// Allocates a workspace of nNewY rows of nNewX vectors, backed by huge
+// pages where possible and interleaved over the NUMA nodes. The pages are
+// not touched yet.
+float8_t* AllocWorkspace(int nNewY, int nNewX)
+{
+    std::size_t bytes = sizeof(float8_t) * nNewY * nNewX;
+    std::size_t alignment = std::max(nAlignment, ppc::placement_alignment(bytes, nWorkspacePlacement));
+    float8_t* workingData = float8_alloc((std::size_t)nNewY * nNewX, alignment);
+    ppc::advise(workingData, bytes, nWorkspacePlacement);
+    return workingData;
+}
+
+// The padded shape of the workspace for ny rows of nx elements, without
+// the workspace itself.
+cp_plan PlanShape(int ny, int nx)
 {
     int nVectors = (nx + nFloat - 1) / nFloat;
     int nExtendedRow = (nVectors + nParallelOps - 1) / nParallelOps;
     int nNewX = nExtendedRow * nParallelOps;
 
-    int nExtendedCol = (ny + nParallelOps - 1) / nParallelOps;
-    int nNewY = nExtendedCol * nParallelOps;
+    int nExtendedCol = (ny + nTilePad - 1) / nTilePad;
+    int nNewY = nExtendedCol * nTilePad;
+    return {ny, nx, nVectors, nNewX, nNewY, nullptr, {}, nullptr};
+}
 
-    float8_t* workingData = float8_alloc(nNewY * nNewX);
-    
-    //copying data to vectors
+// Whether products over the whole triangle of plan use the packed
+// kernel, and over how many float8_t per row.
+bool PacksRows(const cp_plan& plan)
+{
+    return plan.nVectors >= nPackMinVectors;
+}
+
+int PackedSteps(const cp_plan& plan)
+{
+    return (plan.nVectors + 1) / 2 * 2;
+}
+
+cp_plan* cp_plan_create(int ny, int nx)
+{
+    const cp_plan shape = PlanShape(ny, nx);
+    const int nNewX = shape.nNewX;
+    const int nNewY = shape.nNewY;
+
+    float8_t* workingData = AllocWorkspace(nNewY, nNewX);
+    if(workingData == nullptr && nNewY > 0)
+    {
+	return nullptr;
+    }
+
+    //fault the pages in here rather than in execute; the interleave
+    //policy of AllocWorkspace decides their node, not the faulting thread
     #pragma omp parallel for
     for(int y = 0; y < ny; ++y)
     {
-        for(int x = 0; x < nNewX; ++x)
+	for(int x = 0; x < nNewX; ++x)
 	{
-		for(int actFloat = 0; actFloat < nFloat; ++actFloat)
-		{
-			int actCol = actFloat + x * nFloat;
-	 	        workingData[x + nNewX * y][actFloat] = actCol < nx ? data[y * nx + actCol] : 0.;
-		}
+	    workingData[x + nNewX * y] = float8_0;
 	}
     }
-    float8_t zeroVec = {0., 0., 0., 0., 0., 0., 0., 0.};
+    //the padding rows stay zero for all executions
     for(int y = ny; y < nNewY; ++y)
     {
 	for(int x = 0; x < nNewX; ++x)
 	{
-	    workingData[x + nNewX * y] = zeroVec;
+	    workingData[x + nNewX * y] = float8_0;
 	}
     }
-    
-    //first normalization
-    #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
+
+    cp_plan* plan = new cp_plan(shape);
+    plan->workingData = workingData;
+    if(ny > 0)
     {
-        float mean = MeanOfRow(nx, workingData, y, nVectors, nNewX);
-	float8_t meanVec = {mean, mean, mean, mean, mean, mean, mean, mean};
-	
-        for(int actVector = 0; actVector < nVectors - (nx % nFloat == 0 ? 0 : 1); ++actVector)
+	try
 	{
-            workingData[actVector + nNewX * y] -= meanVec;
+	    if(PacksRows(*plan))
+	    {
+		plan->tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nPackRows, nPackCols, tileOrder);
+		plan->scratch = new PackScratch;
+		AllocPackScratch(*plan->scratch, omp_get_max_threads(), std::min(tileKernel.packSteps, PackedSteps(*plan)));
+	    }
+	    else
+	    {
+		plan->tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nBlockRows, nBlockCols, tileOrder);
+	    }
 	}
-	for(int actFloat = 0; actFloat < nx % nFloat; ++actFloat)
+	catch(const std::bad_alloc&)
 	{
-            workingData[(y + 1) * nNewX - (nNewX - nVectors) - 1][actFloat] -= mean;
+	    cp_plan_destroy(plan);
+	    return nullptr;
 	}
-	
     }
-    //second normalization
+    return plan;
+}
+
+// Copies rows y0 <= y < y1 into the padded workspace of the plan, row y
+// being read from data + (y - y0) * nx. If offsets is not null, offsets[y]
+// is subtracted from every element of row y.
+void CopyRows(cp_plan* plan, const float* data, int y0, int y1, const float* offsets)
+{
+    const int nx = plan->nx;
+    const int nNewX = plan->nNewX;
+    float8_t* workingData = plan->workingData;
+
+    //copying data to vectors
     #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
+    for(int y = y0; y < y1; ++y)
     {
-        float denominator = CalculateDenominator(y, workingData, nVectors, nNewX);
-	float8_t denomVec = { denominator, denominator, denominator, denominator, denominator, denominator, denominator, denominator};
-        for(int actVector = 0; actVector < nVectors - (nx % nFloat == 0 ? 0 : 1); ++actVector)
-	{
-            workingData[actVector + nNewX * y] /= denomVec;
-	}
-	for(int actFloat = 0; actFloat < nx % nFloat; ++actFloat)
+	float offset = offsets == nullptr ? 0. : offsets[y];
+        for(int x = 0; x < nNewX; ++x)
 	{
-            workingData[(y + 1) * nNewX - (nNewX - nVectors) - 1][actFloat] /= denominator;
+		for(int actFloat = 0; actFloat < nFloat; ++actFloat)
+		{
+			int actCol = actFloat + x * nFloat;
+	 	        workingData[x + nNewX * y][actFloat] = actCol < nx ? data[(std::size_t)(y - y0) * nx + actCol] - offset : 0.;
+		}
 	}
     }
+}
+
+// Normalizes rows y0 <= y < y1 into the workspace, row y being read from
+// data + (y - y0) * nx.
+void PrepareRows(cp_plan* plan, const float* data, int y0, int y1)
+{
+    const int nx = plan->nx;
+    const int nNewX = plan->nNewX;
+    float8_t* workingData = plan->workingData;
+
+    #pragma omp parallel for
+    for(int y = y0; y < y1; ++y)
+    {
+	normalize_row(data + (std::size_t)(y - y0) * nx, nx, (float*)(workingData + (std::size_t)nNewX * y), nNewX * nFloat);
+    }
+}
+
+// Runs the tiled product over the scheduler tiles of tiles, from
+// triangle_tiles with nBlockRows x nBlockCols tiles. The threads share
+// out the tiles by work stealing. Every thread gets its own epilogue from
+// makeEpilogue().
+template <typename MakeEpilogue>
+void MultiplyTileList(const cp_plan* plan, const std::vector<ppc::tile_range>& tiles, const MakeEpilogue& makeEpilogue)
+{
+    const int ny = plan->ny;
+    const int nVectors = plan->nVectors;
+    const int nNewX = plan->nNewX;
+    const float8_t* workingData = plan->workingData;
+    const TileKernel kernel = tileKernel;
+
+    ppc::parallel_tiles(tiles, [&]()
+    {
+	auto epilogue = makeEpilogue();
+	return [=](const ppc::tile_range& tile) mutable
+	{
+	    for(int y = tile.y0; y < tile.y1; y += kernel.rows)
+	    {
+		for(int x = std::max(tile.x0, y / kernel.cols * kernel.cols); x < tile.x1; x += kernel.cols)
+		{
+		    CalculateTile(kernel, y, x, workingData, nVectors, nNewX, ny, epilogue);
+		}
+	    }
+	};
+    });
+}
 
+// Runs the tiled product over the part of the upper triangle of the
+// prepared rows with y0 <= j < y1 and x0 <= i < x1. y0 and x0 must be
+// multiples of nTilePad: a register tile on the diagonal starts at a
+// multiple of its width, and from an unaligned x0 it would reach into the
+// columns of the next block while another thread works on them. Tiles may
+// reach nTilePad - 1 rows past y1 and x1, so those rows must exist in the
+// workspace.
+// The triangle is cut into blocks of equal cost for MultiplyTileList.
+template <typename MakeEpilogue>
+void MultiplyRange(const cp_plan* plan, int y0, int y1, int x0, int x1, const MakeEpilogue& makeEpilogue)
+{
+    MultiplyTileList(plan, ppc::triangle_tiles(y0, y1, x0, x1, nBlockRows, nBlockCols, tileOrder), makeEpilogue);
+}
 
-    //Matrix multiplication
-    
-    float* res = (float*)malloc(sizeof(float) * nNewY * nNewY);
-    for(int y = 0; y < nNewY; ++y)
+// Copies the nRows rows starting at y, vectors k0 <= k < k0 + nSteps,
+// into the layout of the packed kernel: one panel of nPanelRows rows after
+// the other, each holding step after step of width float8_t of every row.
+// The rows are nNewX vectors of type Element apart, and widen(element,
+// out) stores one of them as a float8_t in out. Vectors of 32 bytes go by
+// reference, as the ABI for passing them by value differs with and
+// without AVX.
+template <typename Element, typename Widen>
+void PackPanels(const Element* workingData, int nNewX, int y, int nRows, int nPanelRows, int k0, int nSteps, int width, const Widen& widen, float8_t* packed)
+{
+    for(int panel = y; panel < y + nRows; panel += nPanelRows)
     {
-        for(int x = 0; x < nNewY; ++x)
+	for(int k = k0; k < k0 + nSteps; k += width)
 	{
-	    res[x + nNewY * y] = 0.;
+	    for(int row = panel; row < panel + nPanelRows; ++row)
+	    {
+		const Element* source = workingData + (std::size_t)row * nNewX + k;
+		for(int w = 0; w < width; ++w)
+		{
+		    widen(source[w], *packed++);
+		}
+	    }
 	}
     }
-    
-    for(int run = 0; run < nNewX; run += nParallelOps)
+}
+
+// The widen of PackPanels for rows that are float8_t already.
+void CopyFloat8(const float8_t& source, float8_t& out)
+{
+    out = source;
+}
+
+// Called by MultiplyPacked on the thread of a tile once the epilogue has
+// had all values of the tile. Epilogues that need the finished tile as a
+// whole overload it.
+template <typename Epilogue>
+void FinishTile(Epilogue&, const ppc::tile_range&)
+{
+}
+
+// The same product as MultiplyTileList over the scheduler tiles of tiles,
+// from triangle_tiles with nPackRows x nPackCols tiles, cache blocked for
+// long rows. The rows have nSteps vectors (an even number) and are stored
+// as in PackPanels. For every k-block of vectors, a block of nPackRows
+// rows and its nPackCols partner rows are packed into contiguous
+// per-thread buffers, and the tile sums of the slices are added up in a
+// per-thread block of results before they go to the epilogue. The order
+// of the epilogue calls within a tile is the same as in MultiplyTileList.
+// The buffers come from scratch; only if it is null or too small for the
+// threads or the k-block size of the kernel in use, they are allocated for
+// this call.
+template <typename Element, typename Widen, typename MakeEpilogue>
+void MultiplyPacked(int ny, int nSteps, const Element* workingData, int nNewX, const Widen& widen, const std::vector<ppc::tile_range>& tiles, const PackScratch* scratch, const MakeEpilogue& makeEpilogue)
+{
+    const TileKernel kernel = tileKernel;
+    const int nThreads = omp_get_max_threads();
+    const int nScratchSteps = std::min(kernel.packSteps, nSteps);
+    PackScratch local;
+    if(scratch == nullptr || scratch->nThreads < nThreads || scratch->nSteps < nScratchSteps)
+    {
+	AllocPackScratch(local, nThreads, nScratchSteps);
+	scratch = &local;
+    }
+    const std::size_t nRowsPacked = (std::size_t)nPackRows * scratch->nSteps;
+    const std::size_t nColsPacked = (std::size_t)nPackCols * scratch->nSteps;
+
+    ppc::parallel_tiles(tiles, [&]()
     {
-        #pragma omp parallel for schedule(static, 1)
-	for(int y = 0; y < nNewY; y += nParallelOps)
+	auto epilogue = makeEpilogue();
+	const int thread = omp_get_thread_num();
+	float8_t* rows = scratch->packed.get() + (nRowsPacked + nColsPacked) * thread;
+	float8_t* cols = rows + nRowsPacked;
+	float* sums = scratch->blockSums.get() + nPackSums * thread;
+	return [=](const ppc::tile_range& tile) mutable
 	{
-	    float8_t reusableCells[nParallelOps * nParallelOps];
-	    std::vector<int> indices;
-	    //copy values to local variable to reuse
-	    for(int row = 0; row < nParallelOps; ++row)
+	    const int nRows = tile.y1 - tile.y0;
+	    const int nCols = tile.x1 - tile.x0;
+	    for(int i = 0; i < nRows * nCols; ++i)
+	    {
+		sums[i] = 0.;
+	    }
+	    for(int k0 = 0; k0 < nSteps; k0 += kernel.packSteps)
 	    {
-		for(int col = 0; col < nParallelOps; ++col)
+		const int nSlice = std::min(kernel.packSteps, nSteps - k0);
+		PackPanels(workingData, nNewX, tile.y0, nRows, kernel.rows, k0, nSlice, kernel.packWidth, widen, rows);
+		PackPanels(workingData, nNewX, tile.x0, nCols, kernel.cols, k0, nSlice, kernel.packWidth, widen, cols);
+		//a column panel is reused from L1 against all row panels in L2
+		for(int x = tile.x0; x < tile.x1; x += kernel.cols)
 		{
-		    reusableCells[col + row * nParallelOps] = workingData[run + col + (y + row) * nNewX];
+		    const float8_t* colPanel = cols + (std::size_t)(x - tile.x0) * nSlice;
+		    for(int y = tile.y0; y < tile.y1 && y / kernel.cols * kernel.cols <= x; y += kernel.rows)
+		    {
+			const float8_t* rowPanel = rows + (std::size_t)(y - tile.y0) * nSlice;
+			kernel.packedSums(rowPanel, colPanel, nSlice, sums + (x - tile.x0) * kernel.rows + (y - tile.y0) * nCols);
+		    }
 		}
 	    }
-	    for(int x = y; x < nNewY; x += nParallelOps)
+	    for(int y = tile.y0; y < tile.y1; y += kernel.rows)
 	    {
-		float8_t partialRes[nParallelOps * nParallelOps];
-		CalculateSum(x, workingData,nNewX, partialRes, run, reusableCells);
-		//copy the results to res array
-		for(int i = 0; i < nParallelOps; ++i)
+		for(int x = std::max(tile.x0, y / kernel.cols * kernel.cols); x < tile.x1; x += kernel.cols)
 		{
-		    for(int j = 0; j < nParallelOps; ++j)
+		    const float* tileSums = sums + (x - tile.x0) * kernel.rows + (y - tile.y0) * nCols;
+		    for(int row = 0; row < kernel.rows && y + row < ny; ++row)
 		    {
-			float sum = 0.;
-			for(int addParts = 0; addParts < nFloat; ++addParts)
+			for(int col = 0; col < kernel.cols && x + col < ny; ++col)
 			{
-			    sum += partialRes[j + i * nParallelOps][addParts];
+			    epilogue(y + row, x + col, tileSums[col + row * kernel.cols]);
 			}
-			res[j + x + (y + i) * nNewY] += sum;
 		    }
 		}
 	    }
+	    FinishTile(epilogue, tile);
+	};
+    });
+}
+
+// Runs the tiled product over the whole upper triangle, with the tiles
+// and scratch of the plan where it has them.
+template <typename MakeEpilogue>
+void MultiplyTiles(const cp_plan* plan, const MakeEpilogue& makeEpilogue)
+{
+    const int nNewY = plan->nNewY;
+    if(PacksRows(*plan))
+    {
+	std::vector<ppc::tile_range> tiles;
+	if(plan->tiles.empty())
+	{
+	    tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nPackRows, nPackCols, tileOrder);
+	}
+	MultiplyPacked(plan->ny, PackedSteps(*plan), plan->workingData, plan->nNewX, CopyFloat8, plan->tiles.empty() ? tiles : plan->tiles, plan->scratch, makeEpilogue);
+	return;
+    }
+    if(plan->tiles.empty())
+    {
+	MultiplyRange(plan, 0, nNewY, 0, nNewY, makeEpilogue);
+	return;
+    }
+    MultiplyTileList(plan, plan->tiles, makeEpilogue);
+}
+
+void cp_plan_execute(cp_plan* plan, const float* data, float* result)
+{
+    const int ny = plan->ny;
+    PrepareRows(plan, data, 0, plan->ny);
+    MultiplyTiles(plan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = value;
+	};
+    });
+}
+
+void cp_plan_destroy(cp_plan* plan)
+{
+    if(plan == nullptr)
+    {
+	return;
+    }
+    free(plan->workingData);
+    delete plan->scratch;
+    delete plan;
+}
+
+void correlate(int ny, int nx, const float* data, float*result)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    cp_plan_execute(plan, data, result);
+    cp_plan_destroy(plan);
+}
+
+// Stores n floats from src to dst. The whole cache lines of dst are
+// written with non-temporal stores, which neither read the old contents
+// of the lines nor keep them in the cache.
+void StreamRow(float* dst, const float* src, int n)
+{
+    int k = 0;
+#ifdef __SSE__
+    const int nLine = ppc::cache_line / sizeof(float);
+    const int misaligned = (std::uintptr_t)dst % ppc::cache_line / sizeof(float);
+    for(; k < n && misaligned != 0 && k < nLine - misaligned; ++k)
+    {
+	dst[k] = src[k];
+    }
+    for(; k + nLine <= n; k += nLine)
+    {
+	for(int w = 0; w < nLine; w += 4)
+	{
+	    _mm_stream_ps(dst + k + w, _mm_loadu_ps(src + k + w));
+	}
+    }
+#endif
+    for(; k < n; ++k)
+    {
+	dst[k] = src[k];
+    }
+}
+
+// Epilogue of correlate_full(): stores the upper triangle as correlate()
+// does, and FinishTile mirrors each finished tile below the diagonal.
+struct MirrorEpilogue
+{
+    float* result;
+    int ny;
+
+    void operator()(int j, int i, float value) const
+    {
+	result[i + (std::size_t)j * ny] = value;
+    }
+};
+
+// The tile was just stored row by row and is still in cache, so each of
+// its columns is gathered from there and written out as a contiguous
+// segment of a row below the diagonal.
+void FinishTile(MirrorEpilogue& epilogue, const ppc::tile_range& tile)
+{
+    const int ny = epilogue.ny;
+    float* result = epilogue.result;
+    float column[nPackRows];
+    for(int i = std::max(tile.x0, tile.y0 + 1); i < std::min(tile.x1, ny); ++i)
+    {
+	const int j1 = std::min(tile.y1, i);
+	for(int j = tile.y0; j < j1; ++j)
+	{
+	    column[j - tile.y0] = result[i + (std::size_t)j * ny];
+	}
+	StreamRow(result + tile.y0 + (std::size_t)i * ny, column, j1 - tile.y0);
+    }
+#ifdef __SSE__
+    _mm_sfence();
+#endif
+}
+
+void correlate_full(int ny, int nx, const float* data, float* result)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    PrepareRows(plan, data, 0, ny);
+    //always the packed product, whose large tiles give long mirrored rows
+    const int nNewY = plan->nNewY;
+    const std::vector<ppc::tile_range> tiles = PacksRows(*plan) ? plan->tiles : ppc::triangle_tiles(0, nNewY, 0, nNewY, nPackRows, nPackCols, tileOrder);
+    MultiplyPacked(ny, PackedSteps(*plan), plan->workingData, plan->nNewX, CopyFloat8, tiles, plan->scratch, [=]()
+    {
+	return MirrorEpilogue{result, ny};
+    });
+    cp_plan_destroy(plan);
+}
+
+int cp_padded_rows(int ny)
+{
+    return PlanShape(ny, 0).nNewY;
+}
+
+int cp_padded_stride(int nx)
+{
+    return PlanShape(0, nx).nNewX * nFloat;
+}
+
+void correlate_padded(int ny, int nx, float* data, float* result)
+{
+    cp_plan plan = PlanShape(ny, nx);
+    const std::size_t stride = (std::size_t)plan.nNewX * nFloat;
+    cp_plan* copy = nullptr;
+    if((std::uintptr_t)data % nAlignment == 0)
+    {
+	plan.workingData = (float8_t*)data;
+    }
+    else
+    {
+	copy = cp_plan_create(ny, nx);
+	if(copy == nullptr)
+	{
+	    throw std::bad_alloc();
 	}
+	plan.workingData = copy->workingData;
     }
-    
+
+    //in place, each element is read before it is overwritten
+    float* rows = (float*)plan.workingData;
     #pragma omp parallel for
-    for(int y = 0; y < ny; ++y)
+    for(int y = 0; y < plan.nNewY; ++y)
     {
-	for(int x = 0; x < ny; ++x)
+	if(y < ny)
+	{
+	    normalize_row(data + y * stride, nx, rows + y * stride, stride);
+	}
+	else
 	{
-	    result[x + y * ny] = res[x + y * nNewY];
+	    std::fill(rows + y * stride, rows + (y + 1) * stride, 0.f);
 	}
     }
-    
-    free(workingData);
-    free(res);
+
+    MultiplyTiles(&plan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = value;
+	};
+    });
+    cp_plan_destroy(copy);
 }
 
+// Normalizes the rows of data into the workspace of plan and zeroes its
+// padding rows, all on the calling thread.
+void PrepareRowsSerial(const cp_plan& plan, const float* data)
+{
+    const std::size_t nNewX = plan.nNewX;
+    for(int y = 0; y < plan.ny; ++y)
+    {
+	normalize_row(data + (std::size_t)y * plan.nx, plan.nx, (float*)(plan.workingData + nNewX * y), nNewX * nFloat);
+    }
+    std::fill(plan.workingData + nNewX * plan.ny, plan.workingData + nNewX * plan.nNewY, float8_0);
+}
 
+// The tiles of the product over the prepared rows of plan, storing the
+// result in the layout of correlate().
+void MultiplyTileRange(const TileKernel& kernel, const cp_plan& plan, const ppc::tile_range& tile, float* result)
+{
+    const int ny = plan.ny;
+    auto epilogue = [=](int j, int i, float value)
+    {
+	result[i + (std::size_t)j * ny] = value;
+    };
+    for(int y = tile.y0; y < tile.y1; y += kernel.rows)
+    {
+	for(int x = std::max(tile.x0, y / kernel.cols * kernel.cols); x < tile.x1; x += kernel.cols)
+	{
+	    CalculateTile(kernel, y, x, plan.workingData, plan.nVectors, plan.nNewX, ny, epilogue);
+	}
+    }
+}
 
+void correlate_batch(int nJobs, const cp_job* jobs)
+{
+    const int nThreads = omp_get_max_threads();
+    const TileKernel kernel = tileKernel;
 
+    //a job that is more than the fair share of one thread is split into
+    //tiles over all threads, the others run whole, the largest first
+    std::vector<cp_plan> shapes(nJobs);
+    std::vector<double> work(nJobs);
+    double totalWork = 0.;
+    for(int t = 0; t < nJobs; ++t)
+    {
+	shapes[t] = PlanShape(jobs[t].ny, jobs[t].nx);
+	work[t] = (double)shapes[t].nNewY * shapes[t].nNewY * shapes[t].nVectors;
+	totalWork += work[t];
+    }
+    std::vector<int> splitJobs;
+    std::vector<int> wholeJobs;
+    std::size_t nSplitWorkspace = 0;
+    for(int t = 0; t < nJobs; ++t)
+    {
+	if(nThreads > 1 && work[t] * nThreads > totalWork)
+	{
+	    splitJobs.push_back(t);
+	    nSplitWorkspace = std::max(nSplitWorkspace, (std::size_t)shapes[t].nNewY * shapes[t].nNewX);
+	}
+	else
+	{
+	    wholeJobs.push_back(t);
+	}
+    }
+    std::stable_sort(wholeJobs.begin(), wholeJobs.end(), [&](int a, int b)
+    {
+	return work[a] > work[b];
+    });
+    ppc::vector<float8_t, nAlignment> splitWorkspace(nSplitWorkspace);
+    //the tile lists of the split jobs are made once, not by every thread
+    std::vector<std::vector<ppc::tile_range>> splitTiles;
+    for(int t : splitJobs)
+    {
+	splitTiles.push_back(ppc::triangle_tiles(0, shapes[t].nNewY, 0, shapes[t].nNewY, nBlockRows, nBlockCols, tileOrder));
+    }
 
+    #pragma omp parallel
+    {
+	//split jobs: every step is shared by the team
+	for(std::size_t split = 0; split < splitJobs.size(); ++split)
+	{
+	    const int t = splitJobs[split];
+	    const std::vector<ppc::tile_range>& tiles = splitTiles[split];
+	    cp_plan plan = shapes[t];
+	    plan.workingData = splitWorkspace.data();
+	    const float* data = jobs[t].data;
+	    #pragma omp for
+	    for(int y = 0; y < plan.nNewY; ++y)
+	    {
+		float* row = (float*)(plan.workingData + (std::size_t)plan.nNewX * y);
+		if(y < plan.ny)
+		{
+		    normalize_row(data + (std::size_t)y * plan.nx, plan.nx, row, plan.nNewX * nFloat);
+		}
+		else
+		{
+		    std::fill(row, row + plan.nNewX * nFloat, 0.f);
+		}
+	    }
+	    #pragma omp for schedule(dynamic, 1)
+	    for(int tile = 0; tile < (int)tiles.size(); ++tile)
+	    {
+		MultiplyTileRange(kernel, plan, tiles[tile], jobs[t].result);
+	    }
+	}
+
+	//whole jobs: one thread each, in a workspace of its own that grows
+	//to the largest job it gets
+	ppc::vector<float8_t, nAlignment> workspace;
+	#pragma omp for schedule(dynamic, 1)
+	for(int w = 0; w < (int)wholeJobs.size(); ++w)
+	{
+	    const int t = wholeJobs[w];
+	    cp_plan plan = shapes[t];
+	    std::size_t nWorkspace = (std::size_t)plan.nNewY * plan.nNewX;
+	    if(workspace.size() < nWorkspace)
+	    {
+		workspace.resize(nWorkspace);
+	    }
+	    plan.workingData = workspace.data();
+	    PrepareRowsSerial(plan, jobs[t].data);
+	    MultiplyTileRange(kernel, plan, {0, plan.nNewY, 0, plan.nNewY}, jobs[t].result);
+	}
+    }
+}
+
+// Messages of the sharded mode. They are fixed-size and hold no
+// pointers, so the protocol works over any stream socket; the rows and
+// the result travel through a shared segment instead. The coordinator
+// sends ShardSetup with the segment descriptor attached, then answers
+// every ShardRequest of a worker, which also reports the previous range
+// as done, with ShardRange (tiles begin <= t < end of the tile list) or
+// ShardStop.
+enum ShardKind
+{
+    ShardSetup,
+    ShardRequest,
+    ShardRange,
+    ShardStop
+};
+
+struct ShardMessage
+{
+    int kind;
+    int ny;
+    int nx;
+    int begin;
+    int end;
+    std::size_t resultOffset;
+    std::size_t bytes;
+};
+
+// Sends message over socket, with the descriptor fd attached if it is
+// not -1. Returns false if the peer is gone.
+bool SendShardMessage(int socket, const ShardMessage& message, int fd)
+{
+    iovec data = {(void*)&message, sizeof(message)};
+    msghdr header = {};
+    header.msg_iov = &data;
+    header.msg_iovlen = 1;
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if(fd >= 0)
+    {
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	cmsghdr* attached = CMSG_FIRSTHDR(&header);
+	attached->cmsg_level = SOL_SOCKET;
+	attached->cmsg_type = SCM_RIGHTS;
+	attached->cmsg_len = CMSG_LEN(sizeof(int));
+	std::memcpy(CMSG_DATA(attached), &fd, sizeof(int));
+    }
+    return sendmsg(socket, &header, MSG_NOSIGNAL) == (ssize_t)sizeof(message);
+}
+
+// Receives a whole message from socket, and the attached descriptor in
+// fd if fd is not null. Returns false if the peer is gone.
+bool ReceiveShardMessage(int socket, ShardMessage& message, int* fd)
+{
+    char* bytes = (char*)&message;
+    std::size_t received = 0;
+    while(received < sizeof(message))
+    {
+	iovec data = {bytes + received, sizeof(message) - received};
+	msghdr header = {};
+	header.msg_iov = &data;
+	header.msg_iovlen = 1;
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+	header.msg_control = control;
+	header.msg_controllen = sizeof(control);
+	ssize_t n = recvmsg(socket, &header, 0);
+	if(n <= 0)
+	{
+	    return false;
+	}
+	cmsghdr* attached = CMSG_FIRSTHDR(&header);
+	if(fd != nullptr && attached != nullptr && attached->cmsg_type == SCM_RIGHTS)
+	{
+	    std::memcpy(fd, CMSG_DATA(attached), sizeof(int));
+	}
+	received += n;
+    }
+    return true;
+}
+
+// The worker side of the sharded mode, in its own process. It maps the
+// segment it is sent and runs the tile ranges it is given on its single
+// thread, writing the result straight into the segment.
+[[noreturn]] void RunShardWorker(int socket)
+{
+    ShardMessage setup;
+    int fd = -1;
+    if(!ReceiveShardMessage(socket, setup, &fd) || setup.kind != ShardSetup || fd < 0)
+    {
+	_exit(EXIT_FAILURE);
+    }
+    void* segment = mmap(nullptr, setup.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(segment == MAP_FAILED)
+    {
+	_exit(EXIT_FAILURE);
+    }
+    cp_plan plan = PlanShape(setup.ny, setup.nx);
+    plan.workingData = (float8_t*)segment;
+    float* result = (float*)((char*)segment + setup.resultOffset);
+    const TileKernel kernel = tileKernel;
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, plan.nNewY, 0, plan.nNewY, nBlockRows, nBlockCols);
+
+    ShardMessage message = {};
+    message.kind = ShardRequest;
+    while(SendShardMessage(socket, message, -1) && ReceiveShardMessage(socket, message, nullptr) && message.kind == ShardRange)
+    {
+	for(int t = message.begin; t < message.end; ++t)
+	{
+	    MultiplyTileRange(kernel, plan, tiles[t], result);
+	}
+	message.kind = ShardRequest;
+    }
+    _exit(message.kind == ShardStop ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+void correlate_sharded(int ny, int nx, const float* data, float* result, int nWorkers)
+{
+    if(ny == 0)
+    {
+	return;
+    }
+    //the segment holds the prepared rows and, from the next cache line
+    //on, the result
+    cp_plan plan = PlanShape(ny, nx);
+    const std::size_t rowBytes = sizeof(float8_t) * plan.nNewY * plan.nNewX;
+    const std::size_t resultOffset = (rowBytes + nAlignment - 1) / nAlignment * nAlignment;
+    const std::size_t bytes = resultOffset + sizeof(float) * ny * ny;
+    int fd = memfd_create("cp-shard", MFD_CLOEXEC);
+    if(fd < 0 || ftruncate(fd, bytes) != 0)
+    {
+	error("cannot create shared segment");
+    }
+    void* segment = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(segment == MAP_FAILED)
+    {
+	error("cannot map shared segment");
+    }
+    plan.workingData = (float8_t*)segment;
+    PrepareRows(&plan, data, 0, ny);
+
+    //the workers are forked after the rows are ready and use no OpenMP
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, plan.nNewY, 0, plan.nNewY, nBlockRows, nBlockCols);
+    nWorkers = std::max(1, std::min(nWorkers, (int)tiles.size()));
+    std::vector<int> sockets(nWorkers);
+    std::vector<pid_t> workers(nWorkers);
+    for(int w = 0; w < nWorkers; ++w)
+    {
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+	{
+	    error("cannot create worker socket");
+	}
+	workers[w] = fork();
+	if(workers[w] < 0)
+	{
+	    error("cannot start worker");
+	}
+	if(workers[w] == 0)
+	{
+	    //a worker only keeps its own socket, the segment comes over it
+	    close(pair[0]);
+	    close(fd);
+	    for(int other = 0; other < w; ++other)
+	    {
+		close(sockets[other]);
+	    }
+	    RunShardWorker(pair[1]);
+	}
+	close(pair[1]);
+	sockets[w] = pair[0];
+	ShardMessage setup = {ShardSetup, ny, nx, 0, 0, resultOffset, bytes};
+	if(!SendShardMessage(sockets[w], setup, fd))
+	{
+	    error("cannot set up worker");
+	}
+    }
+    close(fd);
+
+    //ranges of equal numbers of tiles, several per worker, go to whichever
+    //worker asks first
+    const int nRanges = std::min((int)tiles.size(), 8 * nWorkers);
+    int nextRange = 0;
+    int nRunning = nWorkers;
+    std::vector<pollfd> polls(nWorkers);
+    for(int w = 0; w < nWorkers; ++w)
+    {
+	polls[w] = {sockets[w], POLLIN, 0};
+    }
+    while(nRunning > 0)
+    {
+	if(poll(polls.data(), nWorkers, -1) < 0)
+	{
+	    error("cannot wait for workers");
+	}
+	for(int w = 0; w < nWorkers; ++w)
+	{
+	    if(polls[w].fd < 0 || polls[w].revents == 0)
+	    {
+		continue;
+	    }
+	    ShardMessage message;
+	    if(!ReceiveShardMessage(sockets[w], message, nullptr) || message.kind != ShardRequest)
+	    {
+		error("shard worker failed");
+	    }
+	    if(nextRange < nRanges)
+	    {
+		message.kind = ShardRange;
+		message.begin = (long long)tiles.size() * nextRange / nRanges;
+		message.end = (long long)tiles.size() * (nextRange + 1) / nRanges;
+		++nextRange;
+	    }
+	    else
+	    {
+		message.kind = ShardStop;
+		polls[w].fd = -1;
+		--nRunning;
+	    }
+	    if(!SendShardMessage(sockets[w], message, -1))
+	    {
+		error("shard worker failed");
+	    }
+	}
+    }
+
+    bool failed = false;
+    for(int w = 0; w < nWorkers; ++w)
+    {
+	int status = 0;
+	failed = failed || waitpid(workers[w], &status, 0) != workers[w] || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+	close(sockets[w]);
+    }
+    if(failed)
+    {
+	error("shard worker failed");
+    }
+
+    //gather the rows of the result in the layout of correlate()
+    const float* shared = (const float*)((const char*)segment + resultOffset);
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int j = 0; j < ny; ++j)
+    {
+	std::copy(shared + (std::size_t)j * ny + j, shared + (std::size_t)(j + 1) * ny, result + (std::size_t)j * ny + j);
+    }
+    munmap(segment, bytes);
+}
+
+// Rounds x to the nearest bf16, the upper half of a float, ties to even.
+unsigned short ToBf16(float x)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return bits >> 16;
+}
+
+// Rounds x to the nearest fp16, ties to even, on the bits alone.
+unsigned short ToFp16(float x)
+{
+    std::uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    const std::uint32_t sign = bits >> 16 & 0x8000;
+    bits &= 0x7fffffff;
+    if(bits >= 0x47800000)
+    {
+	//2^16 and up, infinity and NaN
+	return sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00);
+    }
+    if(bits < 0x38800000)
+    {
+	//below 2^-14 the result is subnormal: adding 0.5 leaves x rounded
+	//to a multiple of 2^-24 in the low mantissa bits
+	const std::uint32_t magic = 0x3f000000;
+	float sum;
+	float half;
+	std::memcpy(&half, &magic, sizeof(half));
+	std::memcpy(&sum, &bits, sizeof(sum));
+	sum += half;
+	std::memcpy(&bits, &sum, sizeof(bits));
+	return sign | (bits - magic);
+    }
+    //rebias the exponent and round off 13 mantissa bits, ties to even; a
+    //carry out of the mantissa goes on into the exponent
+    bits += 0xc8000fff + (bits >> 13 & 1);
+    return sign | bits >> 13;
+}
+
+void WidenBf16(const half8_t& halves, float8_t& out)
+{
+    int32x8_t bits;
+    for(int lane = 0; lane < nFloat; ++lane)
+    {
+	bits[lane] = halves[lane] << 16;
+    }
+    out = (float8_t)bits;
+}
+
+// The exponent and mantissa bits of an fp16 moved into place make a float
+// that is 2^-112 times its value, subnormals and zero included.
+void WidenFp16(const half8_t& halves, float8_t& out)
+{
+    int32x8_t bits;
+    for(int lane = 0; lane < nFloat; ++lane)
+    {
+	bits[lane] = halves[lane];
+    }
+    float8_t magnitude = (float8_t)((bits & 0x7fff) << 13) * 0x1p112f;
+    out = (float8_t)((int32x8_t)magnitude | (bits & 0x8000) << 16);
+}
+
+float cp_approx_bound(cp_precision precision)
+{
+    float unit = precision == cp_bf16 ? 0x1p-8f : 0x1p-11f;
+    return 2 * unit + unit * unit;
+}
+
+void correlate_approx(int ny, int nx, const float* data, float* result, cp_precision precision)
+{
+    //whole float16_t steps for the packed kernel
+    const int nVectors = (nx + nFloat - 1) / nFloat;
+    const int nHalfX = (nVectors + 1) / 2 * 2;
+    const int nNewY = (ny + nTilePad - 1) / nTilePad * nTilePad;
+    half8_t* halfData = half8_alloc((std::size_t)nNewY * nHalfX, nAlignment);
+    if(halfData == nullptr && nNewY > 0)
+    {
+	throw std::bad_alloc();
+    }
+
+    //normalization in float, then rounding to 16 bits
+    #pragma omp parallel
+    {
+	std::vector<float> normalized((std::size_t)nHalfX * nFloat);
+	#pragma omp for
+	for(int y = 0; y < nNewY; ++y)
+	{
+	    if(y < ny)
+	    {
+		normalize_row(data + (std::size_t)y * nx, nx, normalized.data(), nHalfX * nFloat);
+	    }
+	    else
+	    {
+		std::fill(normalized.begin(), normalized.end(), 0.f);
+	    }
+	    unsigned short* halves = (unsigned short*)(halfData + (std::size_t)nHalfX * y);
+	    for(int x = 0; x < nHalfX * nFloat; ++x)
+	    {
+		halves[x] = precision == cp_bf16 ? ToBf16(normalized[x]) : ToFp16(normalized[x]);
+	    }
+	}
+    }
+
+    auto makeEpilogue = [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = value;
+	};
+    };
+    const std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nPackRows, nPackCols, tileOrder);
+    if(precision == cp_bf16)
+    {
+	MultiplyPacked(ny, nHalfX, halfData, nHalfX, WidenBf16, tiles, nullptr, makeEpilogue);
+    }
+    else
+    {
+	MultiplyPacked(ny, nHalfX, halfData, nHalfX, WidenFp16, tiles, nullptr, makeEpilogue);
+    }
+    free(halfData);
+}
+
+void correlate_int8(int ny, int nx, const float* data, float* result)
+{
+    const int nSteps = (nx + 15) / 16;
+    const int nNewY = (ny + nTilePad - 1) / nTilePad * nTilePad;
+    int8x16_t* quantized = int8x16_alloc((std::size_t)nNewY * nSteps, nAlignment);
+    if(quantized == nullptr && nNewY > 0)
+    {
+	throw std::bad_alloc();
+    }
+    std::vector<float> scales(nNewY);
+
+    //normalization in float, then rounding to int8 with a scale per row
+    #pragma omp parallel
+    {
+	std::vector<float> normalized((std::size_t)nSteps * 16);
+	#pragma omp for
+	for(int y = 0; y < nNewY; ++y)
+	{
+	    if(y < ny)
+	    {
+		normalize_row(data + (std::size_t)y * nx, nx, normalized.data(), nSteps * 16);
+	    }
+	    else
+	    {
+		std::fill(normalized.begin(), normalized.end(), 0.f);
+	    }
+	    float largest = 0.;
+	    for(float value : normalized)
+	    {
+		largest = std::max(largest, std::fabs(value));
+	    }
+	    float scale = largest / 127;
+	    scales[y] = scale;
+	    signed char* values = (signed char*)(quantized + (std::size_t)nSteps * y);
+	    for(int x = 0; x < nSteps * 16; ++x)
+	    {
+		values[x] = scale > 0 ? std::min(127.f, std::max(-127.f, std::nearbyint(normalized[x] / scale))) : 0;
+	    }
+	}
+    }
+
+    const Int8TileSumsFunction kernel = int8TileSums;
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, nNewY, 0, nNewY, nBlockRows, nBlockCols, tileOrder);
+    ppc::parallel_tiles(tiles, [&]()
+    {
+	return [&](const ppc::tile_range& tile)
+	{
+	    for(int y = tile.y0; y < tile.y1; y += nInt8Rows)
+	    {
+		for(int x = std::max(tile.x0, y / nInt8Cols * nInt8Cols); x < tile.x1; x += nInt8Cols)
+		{
+		    float sums[nInt8Rows * nInt8Cols];
+		    kernel(quantized + (std::size_t)nSteps * y, quantized + (std::size_t)nSteps * x, nSteps, nSteps, sums);
+		    //dequantization with the scales of both rows
+		    for(int row = 0; row < nInt8Rows && y + row < ny; ++row)
+		    {
+			for(int col = 0; col < nInt8Cols && x + col < ny; ++col)
+			{
+			    result[x + col + (std::size_t)(y + row) * ny] = sums[col + row * nInt8Cols] * scales[y + row] * scales[x + col];
+			}
+		    }
+		}
+	    }
+	};
+    });
+    free(quantized);
+}
+
+// Rows sketched together, one per lane of a double4_t.
+constexpr int nSketchRows = 4;
+
+int cp_sketch_size(int ny, int nx, float tolerance)
+{
+    //Gaussian tail bound for all ny * ny / 2 estimates with a standard
+    //deviation of at most sqrt(2 / m), failing with probability 1%
+    double pairs = std::max(1., 0.5 * ny * ny);
+    double m = 4 * std::log(2 * pairs / 0.01) / ((double)tolerance * tolerance);
+    return m < nx ? (int)std::ceil(m) : nx;
+}
+
+// Bucket of element k in the count sketch, times two, plus one if the
+// element is added with a negative sign. A fixed seed makes the sketch
+// the same in every call.
+int SketchBucket(std::uint64_t k, int m)
+{
+    std::uint64_t z = k + 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    return (int)((z >> 1) % m) * 2 + (int)(z & 1);
+}
+
+void correlate_sketch(int ny, int nx, const float* data, float* result, int m)
+{
+    //SketchBucket needs at least one coordinate
+    m = std::max(m, 1);
+    if(m >= nx)
+    {
+	correlate(ny, nx, data, result);
+	return;
+    }
+    cp_plan* plan = cp_plan_create(ny, m);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    const int nNewX = plan->nNewX;
+    float8_t* workingData = plan->workingData;
+
+    //where every element goes, and the sketch of a row of ones
+    std::vector<int> buckets(nx);
+    #pragma omp parallel for
+    for(int x = 0; x < nx; ++x)
+    {
+	buckets[x] = SketchBucket(x, m);
+    }
+    std::vector<double> onesSketch(m);
+    for(int x = 0; x < nx; ++x)
+    {
+	onesSketch[buckets[x] / 2] += buckets[x] & 1 ? -1. : 1.;
+    }
+
+    //one pass over each group of four rows, which share the bucket
+    //lookups: the sketches of the rows shifted by their first elements,
+    //from which the shifted means are removed afterwards, as sketching is
+    //linear; the sketches are then scaled to unit length
+    #pragma omp parallel
+    {
+	std::vector<double4_t> sketch(m);
+	#pragma omp for schedule(dynamic, 1)
+	for(int y0 = 0; y0 < ny; y0 += nSketchRows)
+	{
+	    const float* rows[nSketchRows];
+	    double4_t shift;
+	    for(int row = 0; row < nSketchRows; ++row)
+	    {
+		rows[row] = data + (std::size_t)std::min(y0 + row, ny - 1) * nx;
+		shift[row] = rows[row][0];
+	    }
+	    double4_t sum = double4_0;
+	    std::fill(sketch.begin(), sketch.end(), double4_0);
+	    for(int x = 0; x < nx; ++x)
+	    {
+		double4_t value = {rows[0][x], rows[1][x], rows[2][x], rows[3][x]};
+		value -= shift;
+		sum += value;
+		sketch[buckets[x] / 2] += buckets[x] & 1 ? -value : value;
+	    }
+	    double4_t mean = sum / nx;
+	    double4_t square = double4_0;
+	    for(int b = 0; b < m; ++b)
+	    {
+		sketch[b] -= mean * onesSketch[b];
+		square += sketch[b] * sketch[b];
+	    }
+	    for(int row = 0; row < nSketchRows && y0 + row < ny; ++row)
+	    {
+		double scale = 1. / std::sqrt(square[row]);
+		float* out = (float*)(workingData + (std::size_t)nNewX * (y0 + row));
+		for(int b = 0; b < nNewX * nFloat; ++b)
+		{
+		    out[b] = b < m ? sketch[b][row] * scale : 0.;
+		}
+	    }
+	}
+    }
+
+    MultiplyTiles(plan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = value;
+	};
+    });
+    cp_plan_destroy(plan);
+}
+
+// Stores the ranks 1...nx of the elements of row in ranks, tied elements
+// getting the average of the ranks they span. The elements are sorted as
+// 64-bit keys, the bits of the value made monotonic above the index, so
+// the sort compares plain integers. keys is scratch space for nx keys.
+void RankRow(const float* row, int nx, float* ranks, std::uint64_t* keys)
+{
+    for(int x = 0; x < nx; ++x)
+    {
+	std::uint32_t bits;
+	std::memcpy(&bits, &row[x], sizeof(bits));
+	//negative values count down, -0 ties with +0
+	bits = bits & 0x80000000u ? (bits == 0x80000000u ? 0x80000000u : ~bits) : bits | 0x80000000u;
+	keys[x] = (std::uint64_t)bits << 32 | (std::uint32_t)x;
+    }
+    std::sort(keys, keys + nx);
+    for(int first = 0; first < nx;)
+    {
+	int last = first + 1;
+	while(last < nx && keys[last] >> 32 == keys[first] >> 32)
+	{
+	    ++last;
+	}
+	//ranks first + 1 ... last, exact as long as nx < 2^24
+	float rank = 0.5f * (first + 1 + last);
+	for(int t = first; t < last; ++t)
+	{
+	    ranks[keys[t] & 0xffffffffu] = rank;
+	}
+	first = last;
+    }
+}
+
+void correlate_spearman(int ny, int nx, const float* data, float* result)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    const int nNewX = plan->nNewX;
+    float8_t* workingData = plan->workingData;
+
+    //every thread ranks its rows into its own scratch and normalizes the
+    //ranks straight into the workspace, as PrepareRows does with the data
+    #pragma omp parallel
+    {
+	std::vector<float> ranks(nx);
+	std::vector<std::uint64_t> keys(nx);
+	#pragma omp for schedule(dynamic, 4)
+	for(int y = 0; y < ny; ++y)
+	{
+	    RankRow(data + (std::size_t)y * nx, nx, ranks.data(), keys.data());
+	    normalize_row(ranks.data(), nx, (float*)(workingData + (std::size_t)nNewX * y), nNewX * nFloat);
+	}
+    }
+
+    MultiplyTiles(plan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = value;
+	};
+    });
+    cp_plan_destroy(plan);
+}
+
+// Prepares row y of the missing-data mode: the present elements centered
+// on their mean and scaled to unit length in values, their squares in
+// squares, and 1 for present and 0 for missing elements in mask. Missing
+// elements and the padding are 0 in all three. Returns the mean.
+double PrepareNanRow(const float* row, int nx, int nPadded, float* values, float* squares, float* mask)
+{
+    double sum = 0.;
+    int n = 0;
+    for(int x = 0; x < nx; ++x)
+    {
+	if(!std::isnan(row[x]))
+	{
+	    sum += row[x];
+	    ++n;
+	}
+    }
+    const double mean = n > 0 ? sum / n : 0.;
+    double square = 0.;
+    for(int x = 0; x < nx; ++x)
+    {
+	if(!std::isnan(row[x]))
+	{
+	    square += (row[x] - mean) * (row[x] - mean);
+	}
+    }
+    const double scale = square > 0. ? 1. / std::sqrt(square) : 1.;
+    for(int x = 0; x < nPadded; ++x)
+    {
+	bool present = x < nx && !std::isnan(row[x]);
+	float value = present ? (row[x] - mean) * scale : 0.;
+	values[x] = value;
+	squares[x] = value * value;
+	mask[x] = present ? 1. : 0.;
+    }
+    return mean;
+}
+
+// The pairwise-complete correlation of two rows with means meanA and
+// meanB, in one pass in double. The sums are taken around the means of
+// the whole rows, where double has digits to spare for the cancellation.
+double NanPairCorrelation(const float* a, const float* b, double meanA, double meanB, int nx)
+{
+    double n = 0.;
+    double sumA = 0.;
+    double sumB = 0.;
+    double squareA = 0.;
+    double squareB = 0.;
+    double cross = 0.;
+    for(int x = 0; x < nx; ++x)
+    {
+	const bool shared = !std::isnan(a[x]) && !std::isnan(b[x]);
+	const double deltaA = shared ? a[x] - meanA : 0.;
+	const double deltaB = shared ? b[x] - meanB : 0.;
+	n += shared ? 1. : 0.;
+	sumA += deltaA;
+	sumB += deltaB;
+	squareA += deltaA * deltaA;
+	squareB += deltaB * deltaB;
+	cross += deltaA * deltaB;
+    }
+    const double varianceA = squareA - sumA * sumA / n;
+    const double varianceB = squareB - sumB * sumB / n;
+    return (cross - sumA * sumB / n) / std::sqrt(varianceA * varianceB);
+}
+
+// correlate_nan uses the tile sums of a pair unless the variance of one
+// row over the shared columns is below this fraction of its sum of
+// squares there. The float sums lose about log2(1 / fraction) bits to the
+// subtraction; at 1/256 the error measured at nx = 4000 is still below
+// 4e-6, inside the 1e-5 of correlate().
+constexpr double nNanCancellation = 1. / 256;
+
+// Pairs recomputed by NanPairCorrelation in the last correlate_nan().
+std::atomic<long long> nanRescans{0};
+
+long long correlate_nan_rescans()
+{
+    return nanRescans;
+}
+
+void correlate_nan(int ny, int nx, const float* data, float* result, int* counts)
+{
+    nanRescans = 0;
+    bool missing = false;
+    #pragma omp parallel for reduction(||:missing)
+    for(int y = 0; y < ny; ++y)
+    {
+	for(int x = 0; x < nx; ++x)
+	{
+	    missing = missing || std::isnan(data[x + (std::size_t)y * nx]);
+	}
+    }
+    if(!missing)
+    {
+	correlate(ny, nx, data, result);
+	if(counts != nullptr)
+	{
+	    #pragma omp parallel for
+	    for(int j = 0; j < ny; ++j)
+	    {
+		std::fill(counts + (std::size_t)j * ny + j, counts + (std::size_t)(j + 1) * ny, nx);
+	    }
+	}
+	return;
+    }
+
+    //three workspaces of the shape of correlate() in one allocation: the
+    //values, their squares and the mask of present elements
+    const cp_plan shape = PlanShape(ny, nx);
+    const int nVectors = shape.nVectors;
+    const int nNewX = shape.nNewX;
+    const std::size_t nWorkspace = (std::size_t)shape.nNewY * nNewX;
+    float8_t* workspaces = AllocWorkspace(3 * shape.nNewY, nNewX);
+    if(workspaces == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    float8_t* values = workspaces;
+    float8_t* squares = values + nWorkspace;
+    float8_t* mask = squares + nWorkspace;
+    std::vector<double> means(ny);
+
+    #pragma omp parallel for
+    for(int y = 0; y < shape.nNewY; ++y)
+    {
+	std::size_t row = (std::size_t)nNewX * y;
+	if(y < ny)
+	{
+	    means[y] = PrepareNanRow(data + (std::size_t)y * nx, nx, nNewX * nFloat, (float*)(values + row), (float*)(squares + row), (float*)(mask + row));
+	}
+	else
+	{
+	    for(float8_t* workspace : {values, squares, mask})
+	    {
+		std::fill(workspace + row, workspace + row + nNewX, float8_0);
+	    }
+	}
+    }
+
+    //the sums over the shared columns of a pair are six products of the
+    //workspaces, each done by the tile kernel
+    const TileKernel kernel = tileKernel;
+    std::vector<ppc::tile_range> tiles = ppc::triangle_tiles(0, shape.nNewY, 0, shape.nNewY, nBlockRows, nBlockCols, tileOrder);
+    ppc::parallel_tiles(tiles, [&]()
+    {
+	return [&](const ppc::tile_range& tile)
+	{
+	    long long rescans = 0;
+	    for(int y = tile.y0; y < tile.y1; y += kernel.rows)
+	    {
+		for(int x = std::max(tile.x0, y / kernel.cols * kernel.cols); x < tile.x1; x += kernel.cols)
+		{
+		    const std::size_t rowY = (std::size_t)nNewX * y;
+		    const std::size_t rowX = (std::size_t)nNewX * x;
+		    float shared[nMaxTileSums];
+		    float sumY[nMaxTileSums];
+		    float sumX[nMaxTileSums];
+		    float squareY[nMaxTileSums];
+		    float squareX[nMaxTileSums];
+		    float cross[nMaxTileSums];
+		    kernel.sums(mask + rowY, mask + rowX, nVectors, nNewX, shared);
+		    kernel.sums(values + rowY, mask + rowX, nVectors, nNewX, sumY);
+		    kernel.sums(mask + rowY, values + rowX, nVectors, nNewX, sumX);
+		    kernel.sums(squares + rowY, mask + rowX, nVectors, nNewX, squareY);
+		    kernel.sums(mask + rowY, squares + rowX, nVectors, nNewX, squareX);
+		    kernel.sums(values + rowY, values + rowX, nVectors, nNewX, cross);
+		    for(int row = 0; row < kernel.rows && y + row < ny; ++row)
+		    {
+			//a diagonal tile also holds pairs below the diagonal, which
+			//are left undefined rather than recomputed
+			for(int col = std::max(0, y + row - x); col < kernel.cols && x + col < ny; ++col)
+			{
+			    const int t = col + row * kernel.cols;
+			    const double n = shared[t];
+			    double covariance = cross[t] - sumY[t] * (double)sumX[t] / n;
+			    double varianceY = squareY[t] - sumY[t] * (double)sumY[t] / n;
+			    double varianceX = squareX[t] - sumX[t] * (double)sumX[t] / n;
+			    double denominator = std::sqrt(varianceY * varianceX);
+			    const std::size_t at = x + col + (std::size_t)(y + row) * ny;
+			    if(n < 2)
+			    {
+				result[at] = NAN;
+			    }
+			    else if(varianceY < nNanCancellation * squareY[t] || varianceX < nNanCancellation * squareX[t])
+			    {
+				//most of the spread of a row is in its own mean over
+				//the shared columns, the subtraction would cancel
+				result[at] = NanPairCorrelation(data + (std::size_t)(y + row) * nx, data + (std::size_t)(x + col) * nx, means[y + row], means[x + col], nx);
+				++rescans;
+			    }
+			    else
+			    {
+				result[at] = denominator > 0. ? covariance / denominator : NAN;
+			    }
+			    if(counts != nullptr)
+			    {
+				counts[at] = shared[t];
+			    }
+			}
+		    }
+		}
+	    }
+	    nanRescans += rescans;
+	};
+    });
+    free(workspaces);
+}
+
+// Policies of pairwise<Metric>. prepare(row, nx, out, nPadded) is the
+// prologue: it writes the row into the padded workspace and returns a
+// value of the row for the epilogue. finish(dot, aux_j, aux_i, nx) turns
+// the dot product of two prepared rows into the metric.
+template <typename Metric>
+struct MetricPolicy;
+
+template <>
+struct MetricPolicy<cp_correlation>
+{
+    static double prepare(const float* row, int nx, float* out, int nPadded)
+    {
+	normalize_row(row, nx, out, nPadded);
+	return 0.;
+    }
+
+    static float finish(float dot, double, double, int)
+    {
+	return dot;
+    }
+};
+
+template <>
+struct MetricPolicy<cp_covariance>
+{
+    static double prepare(const float* row, int nx, float* out, int nPadded)
+    {
+	row_moments m = moments_of_row(row, nx);
+	scale_row(row, nx, m.shift + m.sum / nx, 1., out, nPadded);
+	return 0.;
+    }
+
+    static float finish(float dot, double, double, int nx)
+    {
+	return dot / (nx - 1.);
+    }
+};
+
+template <>
+struct MetricPolicy<cp_cosine>
+{
+    static double prepare(const float* row, int nx, float* out, int nPadded)
+    {
+	row_moments m = moments_of_row(row, nx);
+	double square = nx * m.shift * m.shift + 2 * m.shift * m.sum + m.square;
+	scale_row(row, nx, 0., 1. / std::sqrt(square), out, nPadded);
+	return 0.;
+    }
+
+    static float finish(float dot, double, double, int)
+    {
+	return dot;
+    }
+};
+
+template <>
+struct MetricPolicy<cp_euclidean>
+{
+    static double prepare(const float* row, int nx, float* out, int nPadded)
+    {
+	row_moments m = moments_of_row(row, nx);
+	scale_row(row, nx, 0., 1., out, nPadded);
+	return nx * m.shift * m.shift + 2 * m.shift * m.sum + m.square;
+    }
+
+    static float finish(float dot, double squareJ, double squareI, int)
+    {
+	return std::max(0., squareJ + squareI - 2. * dot);
+    }
+};
+
+template <typename Metric>
+void pairwise(int ny, int nx, const float* data, float* result)
+{
+    typedef MetricPolicy<Metric> Policy;
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    const int nNewX = plan->nNewX;
+    float8_t* workingData = plan->workingData;
+
+    std::vector<double> aux(ny);
+    #pragma omp parallel for
+    for(int y = 0; y < ny; ++y)
+    {
+	aux[y] = Policy::prepare(data + (std::size_t)y * nx, nx, (float*)(workingData + (std::size_t)nNewX * y), nNewX * nFloat);
+    }
+
+    const double* rowAux = aux.data();
+    MultiplyTiles(plan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    result[i + (std::size_t)j * ny] = Policy::finish(value, rowAux[j], rowAux[i], nx);
+	};
+    });
+    cp_plan_destroy(plan);
+}
+
+template void pairwise<cp_correlation>(int ny, int nx, const float* data, float* result);
+template void pairwise<cp_covariance>(int ny, int nx, const float* data, float* result);
+template void pairwise<cp_cosine>(int ny, int nx, const float* data, float* result);
+template void pairwise<cp_euclidean>(int ny, int nx, const float* data, float* result);
+
+// Orders sparse output by decreasing magnitude, ties by partner index.
+bool StrongerPair(const cp_pair& a, const cp_pair& b)
+{
+    float absA = std::fabs(a.value);
+    float absB = std::fabs(b.value);
+    return absA != absB ? absA > absB : a.j < b.j;
+}
+
+void correlate_threshold(int ny, int nx, const float* data, float threshold, std::vector<cp_pair>& pairs)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    PrepareRows(plan, data, 0, plan->ny);
+
+    //every thread appends its hits to its own buffer
+    std::vector<std::vector<cp_pair>> threadPairs(omp_get_max_threads());
+    MultiplyTiles(plan, [&]()
+    {
+	std::vector<cp_pair>* own = &threadPairs[omp_get_thread_num()];
+	return [=](int j, int i, float value)
+	{
+	    if(j < i && std::fabs(value) >= threshold)
+	    {
+		own->push_back({i, j, value});
+	    }
+	};
+    });
+    cp_plan_destroy(plan);
+
+    pairs.clear();
+    std::size_t nPairs = 0;
+    for(const auto& own : threadPairs)
+    {
+	nPairs += own.size();
+    }
+    pairs.reserve(nPairs);
+    for(const auto& own : threadPairs)
+    {
+	pairs.insert(pairs.end(), own.begin(), own.end());
+    }
+    std::sort(pairs.begin(), pairs.end(), [](const cp_pair& a, const cp_pair& b)
+    {
+	return a.j != b.j ? a.j < b.j : a.i < b.i;
+    });
+}
+
+void correlate_topk(int ny, int nx, const float* data, int k, cp_pair* pairs)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    PrepareRows(plan, data, 0, plan->ny);
+
+    //pairs[i * k ...] is a bounded min-heap of the partners of row i,
+    //floors[i] is the smallest magnitude in it once it is full
+    std::vector<int> counts(ny, 0);
+    std::vector<float> floors(ny, -1.0f);
+    std::vector<omp_lock_t> locks(ny);
+    for(auto& lock : locks)
+    {
+	omp_init_lock(&lock);
+    }
+    auto offer = [&](int i, int j, float value)
+    {
+	float magnitude = std::fabs(value);
+	float floor;
+	#pragma omp atomic read
+	floor = floors[i];
+	if(magnitude < floor)
+	{
+	    return;
+	}
+	omp_set_lock(&locks[i]);
+	cp_pair* heap = pairs + (std::size_t)i * k;
+	if(counts[i] < k)
+	{
+	    heap[counts[i]++] = {i, j, value};
+	    std::push_heap(heap, heap + counts[i], StrongerPair);
+	}
+	else if(StrongerPair({i, j, value}, heap[0]))
+	{
+	    std::pop_heap(heap, heap + k, StrongerPair);
+	    heap[k - 1] = {i, j, value};
+	    std::push_heap(heap, heap + k, StrongerPair);
+	}
+	if(counts[i] == k)
+	{
+	    #pragma omp atomic write
+	    floors[i] = std::fabs(heap[0].value);
+	}
+	omp_unset_lock(&locks[i]);
+    };
+    if(k > 0)
+    {
+	MultiplyTiles(plan, [&]()
+	{
+	    return [&](int j, int i, float value)
+	    {
+		if(j < i)
+		{
+		    offer(i, j, value);
+		    offer(j, i, value);
+		}
+	    };
+	});
+    }
+    cp_plan_destroy(plan);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for(int i = 0; i < ny; ++i)
+    {
+	cp_pair* heap = pairs + (std::size_t)i * k;
+	std::sort(heap, heap + counts[i], StrongerPair);
+	for(int t = counts[i]; t < k; ++t)
+	{
+	    heap[t] = {i, -1, 0.0f};
+	}
+    }
+    for(auto& lock : locks)
+    {
+	omp_destroy_lock(&lock);
+    }
+}
+
+// Rounds the requested block size to whole tiles.
+int StreamBlockSize(int blockSize)
+{
+    return std::max(1, (blockSize + nTilePad - 1) / nTilePad) * nTilePad;
+}
+
+void correlate_stream(int ny, int nx, const float* data, int blockSize, cp_block_callback callback, void* user)
+{
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    PrepareRows(plan, data, 0, plan->ny);
+
+    //the only output storage is one block, whatever ny is
+    const int nBlock = StreamBlockSize(blockSize);
+    //every thread writes into the block, so it is interleaved like the
+    //workspace
+    ppc::unique_ptr<float> blockStorage = ppc::alloc<float>((std::size_t)nBlock * nBlock, ppc::cache_line, nWorkspacePlacement);
+    float* block = blockStorage.get();
+    if(block == nullptr)
+    {
+	cp_plan_destroy(plan);
+	throw std::bad_alloc();
+    }
+    for(int y0 = 0; y0 < ny; y0 += nBlock)
+    {
+	for(int x0 = y0; x0 < ny; x0 += nBlock)
+	{
+	    int y1 = std::min(y0 + nBlock, plan->nNewY);
+	    int x1 = std::min(x0 + nBlock, plan->nNewY);
+	    MultiplyRange(plan, y0, y1, x0, x1, [=]()
+	    {
+		return [=](int j, int i, float value)
+		{
+		    block[(i - x0) + (j - y0) * nBlock] = value;
+		};
+	    });
+	    callback(y0, x0, std::min(nBlock, ny - y0), std::min(nBlock, ny - x0), block, nBlock, user);
+	}
+    }
+    cp_plan_destroy(plan);
+}
+
+void correlate_to_file(int ny, int nx, const float* data, const char* filename, int blockSize)
+{
+    //the workspace first, so that nothing is left mapped if it fails
+    cp_plan* plan = cp_plan_create(ny, nx);
+    if(plan == nullptr)
+    {
+	throw std::bad_alloc();
+    }
+    PrepareRows(plan, data, 0, plan->ny);
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+    {
+	error(filename, "cannot open for writing");
+    }
+    std::size_t bytes = sizeof(float) * (std::size_t)ny * ny;
+    if(ftruncate(fd, bytes) != 0)
+    {
+	error(filename, "cannot resize output file");
+    }
+    float* result = nullptr;
+    if(bytes > 0)
+    {
+	void* mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+	{
+	    error(filename, "cannot map output file");
+	}
+	result = (float*)mapping;
+    }
+    close(fd);
+
+    //one band of nBlock result rows at a time, each band is handed to
+    //writeback and dropped from the page tables once it is finished
+    const int nBlock = StreamBlockSize(blockSize);
+    const std::size_t pageSize = sysconf(_SC_PAGESIZE);
+    for(int y0 = 0; y0 < ny; y0 += nBlock)
+    {
+	int y1 = std::min(y0 + nBlock, plan->nNewY);
+	for(int x0 = y0; x0 < ny; x0 += nBlock)
+	{
+	    int x1 = std::min(x0 + nBlock, plan->nNewY);
+	    MultiplyRange(plan, y0, y1, x0, x1, [=]()
+	    {
+		return [=](int j, int i, float value)
+		{
+		    result[i + (std::size_t)j * ny] = value;
+		};
+	    });
+	}
+	std::size_t begin = (std::size_t)y0 * ny * sizeof(float) / pageSize * pageSize;
+	std::size_t end = std::min(bytes, (std::size_t)std::min(y1, ny) * ny * sizeof(float));
+	//the last page of the band is shared with the next band, keep it
+	end = end == bytes ? end : end / pageSize * pageSize;
+	if(end > begin)
+	{
+	    msync((char*)result + begin, end - begin, MS_ASYNC);
+	    madvise((char*)result + begin, end - begin, MADV_DONTNEED);
+	}
+    }
+    cp_plan_destroy(plan);
+
+    if(bytes > 0)
+    {
+	if(msync(result, bytes, MS_SYNC) != 0)
+	{
+	    error(filename, "cannot write output file");
+	}
+	munmap(result, bytes);
+    }
+}
+
+struct cp_incremental
+{
+    cp_plan rows;
+};
+
+cp_incremental* cp_incremental_create(int nx)
+{
+    cp_plan* plan = cp_plan_create(0, nx);
+    if(plan == nullptr)
+    {
+	return nullptr;
+    }
+    cp_incremental* incremental = new cp_incremental;
+    incremental->rows = *plan;
+    delete plan;
+    return incremental;
+}
+
+int cp_incremental_rows(const cp_incremental* incremental)
+{
+    return incremental->rows.ny;
+}
+
+void cp_incremental_append(cp_incremental* incremental, int nNew, const float* data, float* strip)
+{
+    cp_plan* plan = &incremental->rows;
+    const int nOld = plan->ny;
+    const int ny = nOld + nNew;
+    const int nNewX = plan->nNewX;
+
+    //grow the workspace geometrically, keeping a tile of zero rows spare
+    if(ny + nTilePad > plan->nNewY)
+    {
+	int nExtendedCol = (std::max(ny, 2 * plan->nNewY) + nTilePad + nTilePad - 1) / nTilePad;
+	int nNewY = nExtendedCol * nTilePad;
+	float8_t* workingData = AllocWorkspace(nNewY, nNewX);
+	if(workingData == nullptr)
+	{
+	    throw std::bad_alloc();
+	}
+	#pragma omp parallel for
+	for(int y = 0; y < nNewY; ++y)
+	{
+	    for(int x = 0; x < nNewX; ++x)
+	    {
+		workingData[x + (std::size_t)nNewX * y] = y < nOld ? plan->workingData[x + (std::size_t)nNewX * y] : float8_0;
+	    }
+	}
+	free(plan->workingData);
+	plan->workingData = workingData;
+	plan->nNewY = nNewY;
+    }
+
+    //only the new rows are normalized and only their strip is multiplied,
+    //from the block of columns that holds the first new row
+    PrepareRows(plan, data, nOld, ny);
+    plan->ny = ny;
+    MultiplyRange(plan, 0, ny, nOld / nTilePad * nTilePad, ny, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    if(j <= i && i >= nOld)
+	    {
+		strip[j + (std::size_t)(i - nOld) * ny] = value;
+	    }
+	};
+    });
+}
+
+void cp_incremental_destroy(cp_incremental* incremental)
+{
+    if(incremental == nullptr)
+    {
+	return;
+    }
+    free(incremental->rows.workingData);
+    delete incremental;
+}
+
+struct cp_rolling
+{
+    int ny;
+    int window;
+    int recompute;
+    int head;
+    int advances;
+    //ring buffer of the last window samples of every row
+    std::vector<float> samples;
+    std::vector<float> outgoing;
+    //running sums over the window of the samples minus offsets
+    std::vector<float> offsets;
+    std::vector<double> sums;
+    std::vector<double> squares;
+    std::vector<double> cross;
+    cp_plan* windowPlan;
+    cp_plan* incomingPlan;
+    cp_plan* outgoingPlan;
+};
+
+// Recomputes all running sums of the window from scratch, re-centering
+// every row on its current mean so that the sums stay small.
+void RecomputeRolling(cp_rolling* rolling)
+{
+    const int ny = rolling->ny;
+    const int window = rolling->window;
+    const float* samples = rolling->samples.data();
+
+    #pragma omp parallel for
+    for(int y = 0; y < ny; ++y)
+    {
+	double sum = 0.;
+	for(int x = 0; x < window; ++x)
+	{
+	    sum += samples[x + (std::size_t)y * window];
+	}
+	float offset = sum / window;
+	double shiftedSum = 0.;
+	double squares = 0.;
+	for(int x = 0; x < window; ++x)
+	{
+	    double value = samples[x + (std::size_t)y * window] - offset;
+	    shiftedSum += value;
+	    squares += value * value;
+	}
+	rolling->offsets[y] = offset;
+	rolling->sums[y] = shiftedSum;
+	rolling->squares[y] = squares;
+    }
+
+    //the order of the samples in the ring does not matter for the sums
+    double* cross = rolling->cross.data();
+    CopyRows(rolling->windowPlan, samples, 0, ny, rolling->offsets.data());
+    MultiplyTiles(rolling->windowPlan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    cross[i + (std::size_t)j * ny] = value;
+	};
+    });
+}
+
+// Writes the correlations of the current window in the layout of
+// correlate().
+void WriteRolling(const cp_rolling* rolling, float* result)
+{
+    const int ny = rolling->ny;
+    const double window = rolling->window;
+    const double* sums = rolling->sums.data();
+    const double* squares = rolling->squares.data();
+    const double* cross = rolling->cross.data();
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int j = 0; j < ny; ++j)
+    {
+	double varianceJ = window * squares[j] - sums[j] * sums[j];
+	for(int i = j; i < ny; ++i)
+	{
+	    double varianceI = window * squares[i] - sums[i] * sums[i];
+	    double covariance = window * cross[i + (std::size_t)j * ny] - sums[i] * sums[j];
+	    result[i + (std::size_t)j * ny] = covariance / std::sqrt(varianceI * varianceJ);
+	}
+    }
+}
+
+cp_rolling* cp_rolling_create(int ny, int window, int recompute)
+{
+    cp_plan* windowPlan = cp_plan_create(ny, window);
+    if(windowPlan == nullptr)
+    {
+	return nullptr;
+    }
+    cp_rolling* rolling = new cp_rolling;
+    rolling->ny = ny;
+    rolling->window = window;
+    rolling->recompute = recompute;
+    rolling->head = 0;
+    rolling->advances = 0;
+    rolling->samples.resize((std::size_t)ny * window);
+    rolling->offsets.resize(ny);
+    rolling->sums.resize(ny);
+    rolling->squares.resize(ny);
+    rolling->cross.resize((std::size_t)ny * ny);
+    rolling->windowPlan = windowPlan;
+    rolling->incomingPlan = nullptr;
+    rolling->outgoingPlan = nullptr;
+    return rolling;
+}
+
+void cp_rolling_start(cp_rolling* rolling, const float* data, float* result)
+{
+    std::copy(data, data + rolling->samples.size(), rolling->samples.begin());
+    rolling->head = 0;
+    rolling->advances = 0;
+    RecomputeRolling(rolling);
+    WriteRolling(rolling, result);
+}
+
+void cp_rolling_advance(cp_rolling* rolling, int step, const float* incoming, float* result)
+{
+    const int ny = rolling->ny;
+    const int window = rolling->window;
+    const int head = rolling->head;
+    float* samples = rolling->samples.data();
+
+    //the outgoing samples are read from the window, so there must be that
+    //many of them
+    if(step < 1 || step > window)
+    {
+	error("cp_rolling_advance: step " + std::to_string(step) + " is not in 1.." + std::to_string(window));
+    }
+
+    if(rolling->incomingPlan == nullptr || rolling->incomingPlan->nx != step)
+    {
+	cp_plan_destroy(rolling->incomingPlan);
+	cp_plan_destroy(rolling->outgoingPlan);
+	rolling->incomingPlan = cp_plan_create(ny, step);
+	rolling->outgoingPlan = cp_plan_create(ny, step);
+	if(rolling->incomingPlan == nullptr || rolling->outgoingPlan == nullptr)
+	{
+	    throw std::bad_alloc();
+	}
+	rolling->outgoing.resize((std::size_t)ny * step);
+    }
+
+    //swap the oldest step samples of every row for the incoming ones
+    float* outgoing = rolling->outgoing.data();
+    #pragma omp parallel for
+    for(int y = 0; y < ny; ++y)
+    {
+	double offset = rolling->offsets[y];
+	double sum = 0.;
+	double squares = 0.;
+	for(int x = 0; x < step; ++x)
+	{
+	    float& slot = samples[(head + x) % window + (std::size_t)y * window];
+	    double oldValue = slot - offset;
+	    double newValue = incoming[x + (std::size_t)y * step] - offset;
+	    sum += newValue - oldValue;
+	    squares += newValue * newValue - oldValue * oldValue;
+	    outgoing[x + (std::size_t)y * step] = slot;
+	    slot = incoming[x + (std::size_t)y * step];
+	}
+	rolling->sums[y] += sum;
+	rolling->squares[y] += squares;
+    }
+    rolling->head = (head + step) % window;
+
+    //the cross products change by a rank-step update in and out
+    double* cross = rolling->cross.data();
+    CopyRows(rolling->incomingPlan, incoming, 0, ny, rolling->offsets.data());
+    CopyRows(rolling->outgoingPlan, outgoing, 0, ny, rolling->offsets.data());
+    MultiplyTiles(rolling->incomingPlan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    cross[i + (std::size_t)j * ny] += value;
+	};
+    });
+    MultiplyTiles(rolling->outgoingPlan, [=]()
+    {
+	return [=](int j, int i, float value)
+	{
+	    cross[i + (std::size_t)j * ny] -= value;
+	};
+    });
+
+    ++rolling->advances;
+    if(rolling->recompute > 0 && rolling->advances % rolling->recompute == 0)
+    {
+	RecomputeRolling(rolling);
+    }
+    WriteRolling(rolling, result);
+}
+
+void cp_rolling_destroy(cp_rolling* rolling)
+{
+    if(rolling == nullptr)
+    {
+	return;
+    }
+    cp_plan_destroy(rolling->windowPlan);
+    cp_plan_destroy(rolling->incomingPlan);
+    cp_plan_destroy(rolling->outgoingPlan);
+    delete rolling;
+}
+
+const char* cp_tune_file()
+{
+    const char* filename = std::getenv("PPC_TUNE_FILE");
+    return filename != nullptr ? filename : "cp-tune.txt";
+}
+
+int cp_tune_variants()
+{
+    return tileKernels.size();
+}
+
+std::string cp_tune_name(int variant)
+{
+    const TileKernel& kernel = tileKernels[variant];
+    return tileIsa + " " + std::to_string(kernel.rows) + "x" + std::to_string(kernel.cols) + " k" + std::to_string(kernel.packSteps);
+}
+
+int cp_tune_current()
+{
+    return tileVariant;
+}
+
+void cp_tune_select(int variant)
+{
+    tileVariant = variant;
+    tileKernel = tileKernels[variant];
+}
+
+void cp_tune_save(int variant, const char* filename)
+{
+    const TileKernel& kernel = tileKernels[variant];
+    std::ofstream file(filename);
+    file << tileIsa << " " << kernel.rows << " " << kernel.cols << " " << kernel.packSteps << "\n";
+    if(!file)
+    {
+	error(filename, "cannot write tuning file");
+    }
+}
@@ -1,6 +1,9 @@
 #ifndef CP_H
 #define CP_H
 
+#include <string>
+#include <vector>
+
 // ny: number of rows in the input matrix.
 // nx: number of columns in the input matrix.
 // data: input matrix, ny * nx elements.
@@ -13,9 +16,252 @@
 // input rows i and j needs to be stored in result[i + j*ny].
 //
 // The elements i < j can be left undefined.
+//
+// The result is written by all threads in tiles spread over the whole
+// matrix. On machines with several NUMA nodes, set an interleave policy
+// on it before anything touches it, e.g. with ppc::alloc<float>(size,
+// ppc::cache_line, ppc::placement_interleave) from memory.h, or with a
+// ppc::vector of that placement. The policy decides where each page lands
+// on its first touch, so its pages do not all end up on the node of the
+// thread that zeroes it.
 
 void correlate(int ny, int nx, const float* data, float* result);
 
+// Full output, for callers that need the whole symmetric matrix:
+// correlate_full stores the correlation between rows i and j in both
+// result[i + j*ny] and result[j + i*ny] for all 0 <= i, j < ny. Each tile
+// of the product is mirrored below the diagonal as soon as it is done,
+// while it is still in cache, instead of in a separate pass over the
+// columns of result.
+void correlate_full(int ny, int nx, const float* data, float* result);
+
+// Reusable workspace for repeated correlate() calls on inputs of the
+// same shape. cp_plan_create allocates and pre-faults the padded buffers,
+// the per-thread scratch of the product for omp_get_max_threads() threads
+// and its list of tiles once (it returns nullptr if that fails),
+// cp_plan_execute then does the same work as correlate(ny, nx, data,
+// result) without allocating or faulting in any buffer, and
+// cp_plan_destroy releases everything. A plan must not be executed from
+// several threads at the same time.
+struct cp_plan;
+
+cp_plan* cp_plan_create(int ny, int nx);
+void cp_plan_execute(cp_plan* plan, const float* data, float* result);
+void cp_plan_destroy(cp_plan* plan);
+
+// Zero-copy mode, for callers that can keep their rows in the padded
+// layout of the kernel: cp_padded_rows(ny) rows of cp_padded_stride(nx)
+// floats, row y at data + y*cp_padded_stride(nx), with data aligned to
+// 64 bytes. The input is the first nx elements of the first ny rows.
+// correlate_padded normalizes the rows in place, overwriting all of data,
+// and runs the product straight on it, so there is no workspace to fill.
+// A data pointer that is not aligned is handled through a copy.
+int cp_padded_rows(int ny);
+int cp_padded_stride(int nx);
+void correlate_padded(int ny, int nx, float* data, float* result);
+
+// Batched mode, for many independent inputs that are each too small to
+// keep all threads busy. correlate_batch does the same as
+// correlate(job.ny, job.nx, job.data, job.result) for every job in
+// jobs[0] ... jobs[nJobs - 1], all in one parallel region: each job runs
+// whole on one thread, unless it is more than the fair share of one
+// thread, in which case its tiles are split over all threads.
+struct cp_job
+{
+    int ny;
+    int nx;
+    const float* data;
+    float* result;
+};
+
+void correlate_batch(int nJobs, const cp_job* jobs);
+
+// Sharded mode, for spreading the product over several processes. The
+// calling process is the coordinator: it prepares the rows in a shared
+// memory segment, forks nWorkers worker processes and hands them ranges
+// of tiles of the upper triangle over Unix sockets as they ask for work.
+// Every worker writes its tiles into the result part of the segment,
+// which is copied to result in the layout of correlate() at the end.
+void correlate_sharded(int ny, int nx, const float* data, float* result, int nWorkers);
+
+// Approximate mode, for when about three significant digits are enough.
+// The normalized rows are stored as 16-bit floats, which halves the
+// memory traffic of the product, and are widened to float to accumulate
+// the products. cp_bf16 has an 8-bit and cp_fp16 an 11-bit significand.
+// Every coefficient differs from the exact one by at most
+// cp_approx_bound(precision) = 2u + u^2, where u is the unit roundoff of
+// the format, plus the rounding error of correlate().
+enum cp_precision
+{
+    cp_bf16,
+    cp_fp16
+};
+
+float cp_approx_bound(cp_precision precision);
+void correlate_approx(int ny, int nx, const float* data, float* result, cp_precision precision);
+
+// Quantized mode, for screening a large ny before an exact recheck of the
+// candidate pairs. Every normalized row x is stored as 8-bit integers
+// round(x / s) with its own scale s = max |x| / 127, a quarter of the
+// bytes of correlate(). The dot products are summed exactly in integers
+// and scaled back, so the error for rows x and y comes from the rounding
+// alone: at most (s_x |y|_1 + s_y |x|_1) / 2 + nx s_x s_y / 4.
+void correlate_int8(int ny, int nx, const float* data, float* result);
+
+// Sketch mode, for rows so long that even the O(ny * ny * nx) product is
+// too slow. Every row is normalized and projected to m dimensions with a
+// count sketch, each element being added with a random sign to one of
+// the m coordinates, in O(ny * nx) time. The sketches are scaled to unit
+// length and correlated with the normal kernel in O(ny * ny * m). Each
+// estimate has a standard deviation of about sqrt(2 / m) or less.
+//
+// cp_sketch_size(ny, nx, tolerance) is the m for which all coefficients
+// are within tolerance of the exact ones with a probability of about 99%,
+// or nx if sketching would not make the rows shorter. correlate_sketch
+// with m >= nx is the same as correlate(), and m < 1 is taken as 1.
+int cp_sketch_size(int ny, int nx, float tolerance);
+void correlate_sketch(int ny, int nx, const float* data, float* result, int m);
+
+// Spearman rank correlation: the Pearson correlation of the ranks of the
+// elements within each row, in the layout of correlate(). Tied elements
+// all get the average of the ranks they span.
+void correlate_spearman(int ny, int nx, const float* data, float* result);
+
+// Missing-data mode: NaN elements of data are missing values. The
+// correlation of rows i and j uses only the columns where both are
+// present, with the means and variances of those columns, and is NaN if
+// they share fewer than two columns or one of them is constant there. If
+// counts is not null, the number of shared columns is stored in
+// counts[i + j*ny] for all 0 <= j <= i < ny. Without any NaN the result
+// is the same as that of correlate().
+//
+// Cost: with any NaN in data, the rows are kept three times in the padded
+// float layout of correlate() (values, their squares and a 0/1 mask of
+// present elements), three times the workspace memory, and every tile
+// takes six products of them instead of one, which makes it about six
+// times slower than correlate() on the same shape. A pair whose shared
+// columns have a mean far from that of a whole row, by more than about
+// 16 standard deviations over those columns, would lose too many digits
+// in those sums and is instead recomputed from the two rows in double,
+// an O(nx) scalar pass. Random missing values never get there, but with
+// structured missingness many pairs may: the worst case is every pair,
+// about a hundred times slower than correlate() (3 us per pair at
+// nx = 1000 on one core). correlate_nan_rescans() tells how many pairs
+// the last call recomputed.
+void correlate_nan(int ny, int nx, const float* data, float* result, int* counts);
+long long correlate_nan_rescans();
+
+// Other pairwise metrics of the rows on the same tiled product, in the
+// layout of correlate(). For all 0 <= j <= i < ny, pairwise<Metric>
+// stores the metric of rows i and j in result[i + j*ny]:
+//   cp_correlation: the same as correlate(),
+//   cp_covariance:  the sample covariance, with nx - 1 degrees of freedom,
+//   cp_cosine:      a.b / (|a| |b|), NaN if either row is all zero,
+//   cp_euclidean:   the squared distance |a|^2 + |b|^2 - 2 a.b, whose
+//                   rounding error is relative to |a|^2 + |b|^2.
+// pairwise is defined for these four metrics only.
+struct cp_correlation {};
+struct cp_covariance {};
+struct cp_cosine {};
+struct cp_euclidean {};
+
+template <typename Metric>
+void pairwise(int ny, int nx, const float* data, float* result);
+
+// Sparse output modes, for when the dense ny * ny result does not fit.
+// A cp_pair holds the correlation between input rows i and j.
+struct cp_pair
+{
+    int i;
+    int j;
+    float value;
+};
+
+// Stores every pair j < i with |correlation| >= threshold in pairs,
+// sorted by j and then by i.
+void correlate_threshold(int ny, int nx, const float* data, float threshold, std::vector<cp_pair>& pairs);
+
+// For all 0 <= i < ny, stores the k partners j != i with the largest
+// |correlation| in pairs[i*k] ... pairs[i*k + k - 1], strongest first.
+// If ny - 1 < k, the remaining entries are set to j = -1, value = 0.
+// pairs must have room for ny * k elements.
+void correlate_topk(int ny, int nx, const float* data, int k, cp_pair* pairs);
+
+// Out-of-core modes, for when the dense ny * ny result does not fit in
+// memory. Both walk the upper triangle in square blocks of blockSize rows
+// (rounded up to whole tiles) and keep only one block in memory.
+//
+// correlate_stream calls callback(j0, i0, nj, ni, block, ld, user) for
+// every block with j0 <= i0, in row-major block order. For all
+// 0 <= j < nj and 0 <= i < ni with j0 + j <= i0 + i, the correlation
+// between input rows i0 + i and j0 + j is in block[i + j*ld].
+typedef void (*cp_block_callback)(int j0, int i0, int nj, int ni, const float* block, int ld, void* user);
+
+void correlate_stream(int ny, int nx, const float* data, int blockSize, cp_block_callback callback, void* user);
+
+// correlate_to_file writes the result in the layout of correlate() to a
+// memory-mapped file of ny * ny floats, releasing each finished band of
+// rows from memory as it goes.
+void correlate_to_file(int ny, int nx, const float* data, const char* filename, int blockSize);
+
+// Incremental mode, for data that grows by appending rows. The normalized
+// rows are kept between calls, so appending only costs the new rows times
+// all rows.
+//
+// cp_incremental_append adds nNew rows of nx elements from data. Let
+// n = cp_incremental_rows() after the call and m = n - nNew. For all
+// 0 <= k < nNew and 0 <= j <= m + k, the correlation between rows j and
+// m + k is stored in strip[j + k*n], which needs room for nNew * n
+// elements. The other elements of strip can be left undefined.
+struct cp_incremental;
+
+cp_incremental* cp_incremental_create(int nx);
+int cp_incremental_rows(const cp_incremental* incremental);
+void cp_incremental_append(cp_incremental* incremental, int nNew, const float* data, float* strip);
+void cp_incremental_destroy(cp_incremental* incremental);
+
+// Rolling mode, for correlations over a sliding window of the last
+// window samples of ny time series. Running sums, sums of squares and
+// cross products are kept between calls, so advancing the window by step
+// samples costs O(ny * ny * step) instead of a full recomputation. Every
+// recompute advances (0 = never) the sums are rebuilt from the window to
+// bound the accumulated rounding error.
+//
+// cp_rolling_start takes the first window, row y at data + y*window.
+// cp_rolling_advance takes 1 <= step <= window new samples per row, row y
+// at incoming + y*step, and stops the program with an error for any
+// other step. Both store the correlations of the current window in
+// result in the layout of correlate().
+struct cp_rolling;
+
+cp_rolling* cp_rolling_create(int ny, int window, int recompute);
+void cp_rolling_start(cp_rolling* rolling, const float* data, float* result);
+void cp_rolling_advance(cp_rolling* rolling, int step, const float* incoming, float* result);
+void cp_rolling_destroy(cp_rolling* rolling);
+
+// Tuning of the tile kernel. It exists in variants for a grid of
+// register tile shapes and k-block sizes, and correlate() and the other
+// entry points use the variant saved in the tuning file, or a default.
+// cp_tune_file() is the name of that file: $PPC_TUNE_FILE if set, else
+// cp-tune.txt in the working directory. It is only read at startup.
+//
+// cp_tune_name(v) describes variant 0 <= v < cp_tune_variants(), e.g.
+// "avx2 4x3 k256". cp_tune_current() is the variant in use, the tuned one
+// until cp_tune_select(v) makes the following calls use variant v; it
+// must not run at the same time as them. cp_tune_save(v, filename) writes
+// v to a tuning file.
+const char* cp_tune_file();
+int cp_tune_variants();
+std::string cp_tune_name(int variant);
+int cp_tune_current();
+void cp_tune_select(int variant);
+void cp_tune_save(int variant, const char* filename);
+
+// This cp.h declares the full-output, plan, zero-copy, batch, sharded,
+// approximate, quantized, sketch, rank, missing-data, pairwise metric,
+// sparse, out-of-core, incremental, rolling and tuning entry points above.
+#define CP_EXTENDED_API 1
+
 constexpr bool STRICT_PRECISION = false;
 
 #endif
@@ -0,0 +1,191 @@
+// Register tile kernel of the correlation product. cp.cc includes this
+// file once per instruction set, each time inside its own namespace and
+// #pragma GCC target region, and picks one of the copies at startup.
+
+// Dot products of the Rows rows starting at rows with the Cols rows
+// starting at cols, nNewX vectors of type Vec apart, over nVectors
+// vectors. The accumulators live in registers for the full reduction and
+// the reduced sums are stored in result[col + row * Cols].
+template <typename Vec, int Rows, int Cols>
+void TileSumsOf(const Vec* rows, const Vec* cols, int nVectors, int nNewX, float* result)
+{
+    constexpr int nLanes = sizeof(Vec) / sizeof(float);
+    Vec sums[Rows][Cols];
+    for(int row = 0; row < Rows; ++row)
+    {
+	for(int col = 0; col < Cols; ++col)
+	{
+	    sums[row][col] = Vec{};
+	}
+    }
+
+    for(int k = 0; k < nVectors; ++k)
+    {
+	Vec colVecs[Cols];
+	for(int col = 0; col < Cols; ++col)
+	{
+	    colVecs[col] = cols[k + col * nNewX];
+	}
+	for(int row = 0; row < Rows; ++row)
+	{
+	    Vec rowVec = rows[k + row * nNewX];
+	    for(int col = 0; col < Cols; ++col)
+	    {
+		sums[row][col] += rowVec * colVecs[col];
+	    }
+	}
+    }
+
+    for(int row = 0; row < Rows; ++row)
+    {
+	for(int col = 0; col < Cols; ++col)
+	{
+	    float sum = 0.;
+	    for(int addParts = 0; addParts < nLanes; ++addParts)
+	    {
+		sum += sums[row][col][addParts];
+	    }
+	    result[col + row * Cols] = sum;
+	}
+    }
+}
+
+// The kernel on the float8_t workspace as it is.
+template <int Rows, int Cols>
+void TileSums(const float8_t* rows, const float8_t* cols, int nVectors, int nNewX, float* result)
+{
+    TileSumsOf<float8_t, Rows, Cols>(rows, cols, nVectors, nNewX, result);
+}
+
+// The same kernel reading the workspace as float16_t, two float8_t at a
+// time. Needs 64-byte aligned rows and an even nNewX; the extra float8_t
+// read past an odd nVectors is zero padding.
+template <int Rows, int Cols>
+void TileSumsWide(const float8_t* rows, const float8_t* cols, int nVectors, int nNewX, float* result)
+{
+    TileSumsOf<float16_t, Rows, Cols>((const float16_t*)rows, (const float16_t*)cols, (nVectors + 1) / 2, nNewX / 2, result);
+}
+
+// The tile kernel on packed panels: step k of the Rows rows is
+// rows[k * Rows + row] and step k of the Cols rows is cols[k * Cols + col],
+// so both are read as one contiguous stream. The sums over the nSteps
+// steps are added to result.
+template <typename Vec, int Rows, int Cols>
+void PackedTileSumsOf(const Vec* rows, const Vec* cols, int nSteps, float* result)
+{
+    constexpr int nLanes = sizeof(Vec) / sizeof(float);
+    Vec sums[Rows][Cols];
+    for(int row = 0; row < Rows; ++row)
+    {
+	for(int col = 0; col < Cols; ++col)
+	{
+	    sums[row][col] = Vec{};
+	}
+    }
+
+    for(int k = 0; k < nSteps; ++k)
+    {
+	Vec colVecs[Cols];
+	for(int col = 0; col < Cols; ++col)
+	{
+	    colVecs[col] = cols[col + k * Cols];
+	}
+	for(int row = 0; row < Rows; ++row)
+	{
+	    Vec rowVec = rows[row + k * Rows];
+	    for(int col = 0; col < Cols; ++col)
+	    {
+		sums[row][col] += rowVec * colVecs[col];
+	    }
+	}
+    }
+
+    for(int row = 0; row < Rows; ++row)
+    {
+	for(int col = 0; col < Cols; ++col)
+	{
+	    float sum = 0.;
+	    for(int addParts = 0; addParts < nLanes; ++addParts)
+	    {
+		sum += sums[row][col][addParts];
+	    }
+	    result[col + row * Cols] += sum;
+	}
+    }
+}
+
+// Packed kernel over nSteps float8_t per row, packed one float8_t per step.
+template <int Rows, int Cols>
+void PackedTileSums(const float8_t* rows, const float8_t* cols, int nSteps, float* result)
+{
+    PackedTileSumsOf<float8_t, Rows, Cols>(rows, cols, nSteps, result);
+}
+
+// Packed kernel over nSteps float8_t per row, packed two float8_t (one
+// float16_t) per step; nSteps must be even.
+template <int Rows, int Cols>
+void PackedTileSumsWide(const float8_t* rows, const float8_t* cols, int nSteps, float* result)
+{
+    PackedTileSumsOf<float16_t, Rows, Cols>((const float16_t*)rows, (const float16_t*)cols, nSteps / 2, result);
+}
+
+// Dot products of Rows quantized rows starting at rows with Cols ones
+// starting at cols, nNewX vectors apart, over nSteps vectors of 16 int8.
+// The rows are widened by WidenInt8 and the products are summed exactly
+// in int32 lanes by MultiplyAddPairs of the including namespace, over
+// runs of nInt8Steps vectors that cannot overflow, and the runs are added
+// up as float in result[col + row * Cols].
+template <int Rows, int Cols>
+void Int8TileSums(const int8x16_t* rows, const int8x16_t* cols, int nSteps, int nNewX, float* result)
+{
+    float totals[Rows][Cols] = {};
+    for(int k0 = 0; k0 < nSteps; k0 += nInt8Steps)
+    {
+	const int k1 = std::min(k0 + nInt8Steps, nSteps);
+	int32x8_t sums[Rows][Cols];
+	for(int row = 0; row < Rows; ++row)
+	{
+	    for(int col = 0; col < Cols; ++col)
+	    {
+		sums[row][col] = int32x8_t{};
+	    }
+	}
+
+	for(int k = k0; k < k1; ++k)
+	{
+	    int16x16_t colVecs[Cols];
+	    for(int col = 0; col < Cols; ++col)
+	    {
+		WidenInt8(cols[k + col * nNewX], colVecs[col]);
+	    }
+	    for(int row = 0; row < Rows; ++row)
+	    {
+		int16x16_t rowVec;
+		WidenInt8(rows[k + row * nNewX], rowVec);
+		for(int col = 0; col < Cols; ++col)
+		{
+		    MultiplyAddPairs(sums[row][col], rowVec, colVecs[col]);
+		}
+	    }
+	}
+
+	for(int row = 0; row < Rows; ++row)
+	{
+	    for(int col = 0; col < Cols; ++col)
+	    {
+		for(int lane = 0; lane < 8; ++lane)
+		{
+		    totals[row][col] += sums[row][col][lane];
+		}
+	    }
+	}
+    }
+
+    for(int row = 0; row < Rows; ++row)
+    {
+	for(int col = 0; col < Cols; ++col)
+	{
+	    result[col + row * Cols] = totals[row][col];
+	}
+    }
+}
@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cmath>
 #include "nn.h"
+#include "memory.h"
 
 // ------------------------------------------------------------------------
 
@@ -116,7 +117,12 @@ static void maxPool2x2(int sz, int n, const float* bufIn, float* bufOut)
 // ------------------------------------------------------------------------
 
 void evalNetwork(float *buf0) {
-    float* buf1 = new float[64 * 224 * 224];
+    // 12 MB ping-pong buffer, on huge pages to keep TLB misses down.
+    auto buffer = ppc::alloc<float>(64 * 224 * 224, ppc::cache_line, ppc::placement_huge_pages);
+    float* buf1 = buffer.get();
+    if (!buf1) {
+        throw std::bad_alloc();
+    }
 
     // Evaluate the network, ping-pong data between buffers.
     printf("Starting inference.\n");
@@ -149,8 +155,6 @@ void evalNetwork(float *buf0) {
 
     printf("Done.\n\n");
     fflush(stdout);
-
-    delete[] buf1;
 }
 
 // ------------------------------------------------------------------------